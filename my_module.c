@@ -9,35 +9,70 @@
 #include <linux/uaccess.h>
 #include <linux/list.h>
 #include <linux/ioctl.h>
-
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/pid.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/fdtable.h>
+#include <linux/version.h>
+#include <linux/tracepoint.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/rculist.h>
+#include <linux/timekeeping.h>
+#include <linux/sort.h>
+
+#include "my_module.h"
 
 #define MEM_SIZE	2048
-#define PS_BFS _IOW('a','a',int32_t*)
-#define PS_DFS _IOW('a','b',int32_t*)
-int received_pid = 0;
+#define PS_QUEUE_SIZE	16384
+#define PS_WATCH_RING	4096	// events buffered per reader, power of two
 
+struct task_entry {
+	struct task_struct *task;
+	int depth;
+};
+
+// Shared by bfs and dfs, dfs uses it as a stack
 struct task_queue {
-	struct task_struct *tasks[1024];
+	struct task_entry entries[PS_QUEUE_SIZE];
 	int front;
 	int rear;
 	int size;
 } tq;
 
-void push_task(struct task_struct* task){
-	tq.tasks[++tq.rear] = task;
-  tq.size++;
-	if(tq.rear == 1023)
-		tq.rear = -1;
+// Serializes traversals since they share tq
+static DEFINE_MUTEX(traverse_lock);
+
+void reset_tasks(void){
+	tq.front = 0;
+	tq.rear = PS_QUEUE_SIZE - 1;
+	tq.size = 0;
 }
 
-struct task_struct* pop_task(void){
-	struct task_struct* task = tq.tasks[tq.front];
-	tq.tasks[tq.front] = NULL;
-	tq.front++;
+int push_task(struct task_struct* task, int depth){
+	if (tq.size == PS_QUEUE_SIZE)
+		return -ENOSPC;
+	tq.rear = (tq.rear + 1) % PS_QUEUE_SIZE;
+	tq.entries[tq.rear].task = task;
+	tq.entries[tq.rear].depth = depth;
+	tq.size++;
+	return 0;
+}
+
+struct task_entry pop_task(void){
+	struct task_entry entry = tq.entries[tq.front];
+	tq.front = (tq.front + 1) % PS_QUEUE_SIZE;
+	tq.size--;
+	return entry;
+}
+
+struct task_entry pop_last_task(void){
+	struct task_entry entry = tq.entries[tq.rear];
+	tq.rear = (tq.rear - 1 + PS_QUEUE_SIZE) % PS_QUEUE_SIZE;
 	tq.size--;
-	if(tq.front == 1023)
-		tq.front = 0;
-	return task;
+	return entry;
 }
 
 dev_t dev = 0;
@@ -48,19 +83,23 @@ static struct cdev my_cdev;
 static int __init my_driver_init(void);
 static void __exit my_driver_exit(void);
 static long my_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static ssize_t my_read(struct file *file, char __user *buf, size_t len, loff_t *off);
+static __poll_t my_poll(struct file *file, poll_table *wait);
+static int my_release(struct inode *inode, struct file *file);
 
 static struct file_operations fops = 
 {
 	.owner	= THIS_MODULE,
 	.unlocked_ioctl = my_ioctl,
+	.read	= my_read,
+	.poll	= my_poll,
+	.release = my_release,
 };
 
 static int __init my_driver_init(void)
 {
 	// initializing the task queue
-	tq.front = 0;
-	tq.rear = -1;
-	tq.size = 0;
+	reset_tasks();
 
 	/* Allocating Major number dynamically*/
 	/* &dev is address of the device */
@@ -112,74 +151,660 @@ void __exit my_driver_exit(void) {
 	printk(KERN_INFO "Device driver is removed successfully...\n");
 }
 
-void dfs_helper(struct task_struct *task){
-	struct task_struct *child;
-	struct list_head *task_list;
+// Maps a task to one of the PS_STATE_* bits
+static u32 task_ps_state(struct task_struct *task){
+	unsigned int state;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+	state = READ_ONCE(task->__state);
+#else
+	state = READ_ONCE(task->state);
+#endif
+	if (task->exit_state & EXIT_ZOMBIE)
+		return PS_STATE_ZOMBIE;
+	if (state == TASK_RUNNING)
+		return PS_STATE_RUNNING;
+	// idle kernel threads sleep uninterruptibly but do not count as D-state
+	if ((state & TASK_UNINTERRUPTIBLE) && !(state & TASK_NOLOAD))
+		return PS_STATE_DSTATE;
+	return PS_STATE_OTHER;
+}
+
+// Called for every task of a walk, returns false to stop the walk
+typedef bool (*visit_fn)(struct task_struct *task, int depth, void *data);
 
-	printk(KERN_INFO "task: %s, pid: %d\n", task->comm, task->pid);
+struct traverse_ctx {
+	struct ps_traverse_args *args;
+	struct ps_node *nodes;
+};
+
+// Copies the task into the next free node if it passes the filters
+static bool visit_task(struct task_struct *task, int depth, void *data){
+	struct traverse_ctx *ctx = data;
+	struct ps_traverse_args *args = ctx->args;
+	struct ps_node *node;
+	u32 state = task_ps_state(task);
+
+	if (args->state_mask && !(args->state_mask & state))
+		return true;
+
+	node = &ctx->nodes[args->count];
+	get_task_comm(node->comm, task);
+	if (args->comm[0] && !strstr(node->comm, args->comm))
+		return true;
+
+	node->pid = task->pid;
+	node->ppid = rcu_dereference(task->real_parent)->tgid;
+	node->depth = depth;
+	node->state = state;
+	return ++args->count < args->limit;
+}
 
-	list_for_each(task_list, &task->children){
-		child = list_entry(task_list, struct task_struct, sibling);
-		dfs_helper(child);
+static unsigned int count_open_fds(struct files_struct *files){
+	struct fdtable *fdt = files_fdtable(files);
+
+	return bitmap_weight(fdt->open_fds, fdt->max_fds);
+}
+
+// Adds the resource usage of the process to the running totals
+static bool sum_task(struct task_struct *task, int depth, void *data){
+	struct ps_sum_args *sum = data;
+	struct task_struct *thread;
+
+	sum->processes++;
+	sum->threads += get_nr_threads(task);
+
+	// live threads plus what already exited threads left in signal_struct
+	sum->utime_ns += task->signal->utime;
+	sum->stime_ns += task->signal->stime;
+	for_each_thread(task, thread){
+		sum->utime_ns += thread->utime;
+		sum->stime_ns += thread->stime;
 	}
+
+	// task_lock keeps mm and files from being detached while we read them
+	task_lock(task);
+	if (task->mm)
+		sum->rss_bytes += (u64) get_mm_rss(task->mm) << PAGE_SHIFT;
+	if (task->files)
+		sum->open_fds += count_open_fds(task->files);
+	task_unlock(task);
+	return true;
 }
 
-void dfs(pid_t pid){
-	struct task_struct *task;
+static bool count_task(struct task_struct *task, int depth, void *data){
+	(*(u32 *) data)++;
+	return true;
+}
 
-	for_each_process(task){
-		if (task->pid == pid){
-			printk(KERN_INFO "DFS for the task: %s, pid: %d\n", task->comm, task->pid);
-			dfs_helper(task);
+// Queues the children of every thread of the task, in reverse order for dfs
+// so that popping from the rear visits them left to right. Children that are
+// being released are skipped, their links may already be gone.
+static int push_children(struct task_struct *task, int depth, bool reverse){
+	struct task_struct *thread, *child;
+
+	if (!pid_alive(task))
+		return 0;
+	for_each_thread(task, thread){
+		if (reverse){
+			list_for_each_entry_reverse(child, &thread->children, sibling)
+				if (pid_alive(child) && push_task(child, depth))
+					return -ENOSPC;
+		} else {
+			list_for_each_entry(child, &thread->children, sibling)
+				if (pid_alive(child) && push_task(child, depth))
+					return -ENOSPC;
 		}
 	}
-	printk(KERN_INFO "End of DFS");
+	return 0;
 }
 
-void bfs_helper(void){
-	struct task_struct *child;
+// Walks the subtree rooted at pid, depth first if dfs is set and breadth first
+// otherwise, calling visit on every task down to max_depth (-1 for no limit).
+// Sets PS_TRUNCATED in flags if the walk stopped before the end, with
+// PS_QUEUE_FULL if it was for lack of room in tq.
+// Must be called with traverse_lock held. The walk runs under rcu_read_lock,
+// which keeps every task it reaches from being freed.
+static int walk_subtree(pid_t pid, int max_depth, bool dfs, visit_fn visit, void *data, u32 *flags){
 	struct task_struct *task;
-	struct list_head *list;
-
-	while(tq.size != 0){
-		task = pop_task();
-		
-		list_for_each(list, &task->children){
-			child= list_entry(list, struct task_struct, sibling);
-			push_task(child);
-			printk(KERN_INFO "task: %s, pid: %d\n", child->comm, child->pid);
+	struct task_entry entry;
+	bool more;
+
+	*flags = 0;
+	reset_tasks();
+
+	rcu_read_lock();
+	task = pid_task(find_vpid(pid), PIDTYPE_PID);
+	if (!task){
+		rcu_read_unlock();
+		return -ESRCH;
+	}
+	push_task(task, 0);
+
+	while (tq.size != 0){
+		entry = dfs ? pop_last_task() : pop_task();
+		more = visit(entry.task, entry.depth, data);
+
+		if (max_depth < 0 || entry.depth < max_depth){
+			if (push_children(entry.task, entry.depth + 1, dfs)){
+				*flags |= PS_TRUNCATED | PS_QUEUE_FULL;
+				break;
+			}
+		}
+		if (!more){
+			if (tq.size != 0)
+				*flags |= PS_TRUNCATED;
+			break;
 		}
 	}
+	rcu_read_unlock();
+	return 0;
 }
 
-void bfs(pid_t target_pid){
-	struct task_struct *task;
+static long traverse_ioctl(unsigned int cmd, unsigned long arg){
+	struct ps_traverse_args args;
+	struct traverse_ctx ctx = { .args = &args };
+	int ret;
+
+	if (copy_from_user(&args, (void __user *) arg, sizeof(args)))
+		return -EFAULT;
+	if (args.limit == 0)
+		return -EINVAL;
+	if (args.limit > PS_MAX_NODES)
+		args.limit = PS_MAX_NODES;
+	args.comm[PS_COMM_LEN - 1] = 0;
+	args.count = 0;
+
+	ctx.nodes = kvmalloc_array(args.limit, sizeof(*ctx.nodes), GFP_KERNEL);
+	if (!ctx.nodes)
+		return -ENOMEM;
+
+	mutex_lock(&traverse_lock);
+	ret = walk_subtree(args.pid, args.max_depth, cmd == PS_DFS, visit_task, &ctx, &args.flags);
+	mutex_unlock(&traverse_lock);
+
+	if (ret == 0 && copy_to_user(u64_to_user_ptr(args.nodes), ctx.nodes, sizeof(*ctx.nodes) * args.count))
+		ret = -EFAULT;
+	if (ret == 0 && copy_to_user((void __user *) arg, &args, sizeof(args)))
+		ret = -EFAULT;
+	kvfree(ctx.nodes);
+	return ret;
+}
+
+struct root_leader {
+	struct task_struct *leader;
+	int index;	// in the roots of the batch
+};
+
+static int compare_leaders(const void *a, const void *b){
+	const struct root_leader *x = a, *y = b;
+
+	if (x->leader != y->leader)
+		return x->leader < y->leader ? -1 : 1;
+	return x->index - y->index;
+}
+
+// First entry of the sorted leaders for task, or -1
+static int find_leader(struct root_leader *leaders, int n, struct task_struct *task){
+	int lo = 0, hi = n;
+
+	while (lo < hi){
+		int mid = lo + (hi - lo) / 2;
+
+		if (leaders[mid].leader < task)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < n && leaders[lo].leader == task ? lo : -1;
+}
+
+// Sets error and covered_by of every root of a batch. A root is covered by an
+// earlier root of the same process and, when the walks have no depth limit,
+// by a root that is one of its ancestors, since that walk reaches the whole
+// subtree. With a limit the ancestor's walk stops above the bottom of it.
+// Returns the number of covered roots.
+static u32 find_covered_roots(struct ps_batch_root *roots, struct root_leader *leaders, int count, bool unlimited){
+	struct task_struct *task, *p;
+	u32 merged = 0;
+	int i, j, n = 0;
+
+	rcu_read_lock();
+	for (i = 0; i < count; i++){
+		task = pid_task(find_vpid(roots[i].pid), PIDTYPE_PID);
+		roots[i].covered_by = -1;
+		roots[i].error = task ? 0 : -ESRCH;
+		if (task){
+			leaders[n].leader = task->group_leader;
+			leaders[n].index = i;
+			n++;
+		}
+	}
+	sort(leaders, n, sizeof(*leaders), compare_leaders, NULL);
 
-	for_each_process(task){
-		if (task->pid == target_pid){
-				printk(KERN_INFO "BFS for the task: %s, pid: %d\n", task->comm, task->pid);
-				push_task(task);
-				bfs_helper();
+	for (i = 0; i < n; i++){
+		j = find_leader(leaders, n, leaders[i].leader);
+		if (leaders[j].index != leaders[i].index){
+			roots[leaders[i].index].covered_by = leaders[j].index;
+			continue;
+		}
+		if (!unlimited)
+			continue;
+		// pid 0 is the idle task, the parent of init and kthreadd
+		p = leaders[i].leader;
+		while (p->pid != 0 && pid_alive(p)){
+			p = rcu_dereference(p->real_parent)->group_leader;
+			j = find_leader(leaders, n, p);
+			if (j >= 0){
+				roots[leaders[i].index].covered_by = leaders[j].index;
+				break;
+			}
 		}
 	}
-	printk(KERN_INFO "End of BFS");
+	rcu_read_unlock();
+
+	// point every covered root at the root that is actually walked
+	for (i = 0; i < count; i++){
+		if (roots[i].covered_by < 0)
+			continue;
+		while (roots[roots[i].covered_by].covered_by >= 0)
+			roots[i].covered_by = roots[roots[i].covered_by].covered_by;
+		merged++;
+	}
+	return merged;
 }
 
-static long my_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
-{
-	if (copy_from_user(&received_pid ,(int*) arg, sizeof(received_pid)))
+// Walks one root of a batch into the free part of nodes.
+// Must be called with traverse_lock held.
+static void batch_walk_root(struct ps_batch_args *args, struct ps_batch_root *root, struct ps_node *nodes){
+	struct ps_traverse_args walk;
+	struct traverse_ctx ctx = { .args = &walk, .nodes = nodes + args->count };
+
+	root->first = args->count;
+	root->count = 0;
+	root->flags = 0;
+	if (args->count == args->limit){
+		root->flags = PS_TRUNCATED;
+		args->flags |= PS_TRUNCATED;
+		return;
+	}
+
+	memset(&walk, 0, sizeof(walk));
+	walk.max_depth = args->max_depth;
+	walk.state_mask = args->state_mask;
+	walk.limit = args->limit - args->count;
+	memcpy(walk.comm, args->comm, PS_COMM_LEN);
+	// the process may have exited since find_covered_roots
+	root->error = walk_subtree(root->pid, args->max_depth, args->dfs, visit_task, &ctx, &root->flags);
+	root->count = walk.count;
+	args->count += walk.count;
+	args->flags |= root->flags;
+}
+
+// Walks every root of the batch under a single hold of traverse_lock. The
+// nodes of the roots follow each other in one buffer copied out at the end.
+static long batch_ioctl(unsigned long arg){
+	struct ps_batch_args args;
+	struct ps_batch_root *roots, *root;
+	struct root_leader *leaders;
+	struct ps_node *nodes;
+	int i, ret = 0;
+
+	if (copy_from_user(&args, (void __user *) arg, sizeof(args)))
 		return -EFAULT;
+	if (args.root_count == 0 || args.root_count > PS_MAX_ROOTS || args.limit == 0)
+		return -EINVAL;
+	if (args.limit > PS_MAX_NODES)
+		args.limit = PS_MAX_NODES;
+	args.comm[PS_COMM_LEN - 1] = 0;
+	args.count = args.flags = 0;
+
+	roots = kvmalloc_array(args.root_count, sizeof(*roots), GFP_KERNEL);
+	leaders = kvmalloc_array(args.root_count, sizeof(*leaders), GFP_KERNEL);
+	nodes = kvmalloc_array(args.limit, sizeof(*nodes), GFP_KERNEL);
+	if (!roots || !leaders || !nodes){
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (copy_from_user(roots, u64_to_user_ptr(args.roots), sizeof(*roots) * args.root_count)){
+		ret = -EFAULT;
+		goto out;
+	}
 
-	if (cmd == PS_BFS)
-		bfs(received_pid);
-	else if (cmd == PS_DFS)
-		dfs(received_pid);
-	else
-		printk(KERN_INFO "Invalid command");
+	mutex_lock(&traverse_lock);
+	args.merged = find_covered_roots(roots, leaders, args.root_count, args.max_depth < 0);
+	for (i = 0; i < args.root_count; i++){
+		root = &roots[i];
+		if (root->error || root->covered_by >= 0){
+			root->first = args.count;
+			root->count = 0;
+			root->flags = 0;
+			continue;
+		}
+		batch_walk_root(&args, root, nodes);
+	}
+	// the nodes of a truncated or failed walk do not hold the whole subtree
+	// of the roots it covers, so those are walked on their own
+	for (i = 0; i < args.root_count; i++){
+		root = &roots[i];
+		if (root->covered_by < 0 || (!roots[root->covered_by].error && !roots[root->covered_by].flags))
+			continue;
+		root->covered_by = -1;
+		args.merged--;
+		batch_walk_root(&args, root, nodes);
+	}
+	mutex_unlock(&traverse_lock);
+
+	if (copy_to_user(u64_to_user_ptr(args.nodes), nodes, sizeof(*nodes) * args.count) ||
+	    copy_to_user(u64_to_user_ptr(args.roots), roots, sizeof(*roots) * args.root_count) ||
+	    copy_to_user((void __user *) arg, &args, sizeof(args)))
+		ret = -EFAULT;
+out:
+	kvfree(nodes);
+	kvfree(leaders);
+	kvfree(roots);
+	return ret;
+}
+
+// Aggregates resource usage over the subtree in the same pass as the walk
+static long sum_ioctl(unsigned long arg){
+	struct ps_sum_args sum;
+	int ret;
+
+	if (copy_from_user(&sum, (void __user *) arg, sizeof(sum)))
+		return -EFAULT;
+	sum.processes = sum.threads = sum.open_fds = 0;
+	sum.rss_bytes = sum.utime_ns = sum.stime_ns = 0;
+
+	mutex_lock(&traverse_lock);
+	ret = walk_subtree(sum.pid, sum.max_depth, false, sum_task, &sum, &sum.flags);
+	mutex_unlock(&traverse_lock);
+
+	if (ret == 0 && copy_to_user((void __user *) arg, &sum, sizeof(sum)))
+		ret = -EFAULT;
+	return ret;
+}
+
+// Runs a full bfs or dfs with a visitor that only counts tasks, so the time
+// measured is the cost of the walk itself
+static long bench_ioctl(unsigned long arg){
+	struct ps_bench_args bench;
+	u64 start;
+	int ret;
+
+	if (copy_from_user(&bench, (void __user *) arg, sizeof(bench)))
+		return -EFAULT;
+	bench.visited = 0;
+
+	mutex_lock(&traverse_lock);
+	start = ktime_get_ns();
+	ret = walk_subtree(bench.pid, -1, bench.dfs, count_task, &bench.visited, &bench.flags);
+	bench.elapsed_ns = ktime_get_ns() - start;
+	mutex_unlock(&traverse_lock);
+
+	if (ret == 0 && copy_to_user((void __user *) arg, &bench, sizeof(bench)))
+		ret = -EFAULT;
+	return ret;
+}
+
+// Per reader state of the watch mode. The tracepoint probes are the only
+// producers and are serialized by lock, the reader consumes without it.
+struct ps_watcher {
+	struct list_head list;
+	pid_t root;
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	struct mutex read_lock;
+	unsigned int head;	// next slot to write
+	unsigned int tail;	// next slot to read
+	atomic_t lost;
+	struct ps_event ring[PS_WATCH_RING];
+};
+
+static LIST_HEAD(watchers);
+static DEFINE_MUTEX(watch_lock);	// protects watchers updates and probe registration
+static struct tracepoint *tp_fork, *tp_exit;
+
+// True if the process or one of its ancestors is root
+static bool is_descendant(struct task_struct *task, pid_t root){
+	while (task->pid > 1){
+		if (task->tgid == root)
+			return true;
+		task = rcu_dereference(task->real_parent);
+	}
+	return task->tgid == root;
+}
+
+static void push_event(struct ps_watcher *w, u32 type, struct task_struct *task, pid_t ppid){
+	struct ps_event *event;
+	unsigned int head;
+
+	spin_lock(&w->lock);
+	head = w->head;
+	if (head - smp_load_acquire(&w->tail) == PS_WATCH_RING){
+		atomic_inc(&w->lost);
+		spin_unlock(&w->lock);
+		return;
+	}
+	event = &w->ring[head & (PS_WATCH_RING - 1)];
+	event->time_ns = ktime_get_ns();
+	event->type = type;
+	event->pid = task->tgid;
+	event->ppid = ppid;
+	event->status = type == PS_EVENT_EXIT ? task->exit_code : 0;
+	get_task_comm(event->comm, task);
+	smp_store_release(&w->head, head + 1);
+	spin_unlock(&w->lock);
+
+	wake_up_interruptible(&w->wait);
+}
+
+static void probe_fork(void *data, struct task_struct *parent, struct task_struct *child){
+	struct ps_watcher *w;
+
+	if (!thread_group_leader(child))	// new thread, not a new process
+		return;
+	rcu_read_lock();
+	list_for_each_entry_rcu(w, &watchers, list)
+		if (is_descendant(parent, READ_ONCE(w->root)))
+			push_event(w, PS_EVENT_FORK, child, parent->tgid);
+	rcu_read_unlock();
+}
+
+static void probe_exit(void *data, struct task_struct *task){
+	struct ps_watcher *w;
+
+	if (!thread_group_leader(task))
+		return;
+	rcu_read_lock();
+	list_for_each_entry_rcu(w, &watchers, list)
+		if (is_descendant(task, READ_ONCE(w->root)))
+			push_event(w, PS_EVENT_EXIT, task, rcu_dereference(task->real_parent)->tgid);
+	rcu_read_unlock();
+}
+
+static void find_tracepoint(struct tracepoint *tp, void *priv){
+	if (strcmp(tp->name, "sched_process_fork") == 0)
+		tp_fork = tp;
+	else if (strcmp(tp->name, "sched_process_exit") == 0)
+		tp_exit = tp;
+}
+
+// Hooks fork and exit for the first watcher. Must be called with watch_lock held.
+static int register_probes(void){
+	int ret;
+
+	if (!tp_fork || !tp_exit)
+		for_each_kernel_tracepoint(find_tracepoint, NULL);
+	if (!tp_fork || !tp_exit)
+		return -ENOSYS;
+
+	ret = tracepoint_probe_register(tp_fork, probe_fork, NULL);
+	if (ret)
+		return ret;
+	ret = tracepoint_probe_register(tp_exit, probe_exit, NULL);
+	if (ret){
+		tracepoint_probe_unregister(tp_fork, probe_fork, NULL);
+		return ret;
+	}
+	return 0;
+}
+
+// Must be called with watch_lock held
+static void unregister_probes(void){
+	tracepoint_probe_unregister(tp_fork, probe_fork, NULL);
+	tracepoint_probe_unregister(tp_exit, probe_exit, NULL);
+	tracepoint_synchronize_unregister();
+}
+
+// Starts streaming fork/exit events of the subtree to this file, or moves an
+// existing watch to another root
+static long watch_ioctl(struct file *file, unsigned long arg){
+	struct ps_watch_args args;
+	struct ps_watcher *w;
+	int ret = 0;
+
+	if (copy_from_user(&args, (void __user *) arg, sizeof(args)))
+		return -EFAULT;
+	if (args.flags)
+		return -EINVAL;
+
+	rcu_read_lock();
+	if (!pid_task(find_vpid(args.pid), PIDTYPE_PID))
+		ret = -ESRCH;
+	rcu_read_unlock();
+	if (ret)
+		return ret;
+
+	mutex_lock(&watch_lock);
+	w = file->private_data;
+	if (w){
+		WRITE_ONCE(w->root, args.pid);
+		goto out;
+	}
+
+	w = kvzalloc(sizeof(*w), GFP_KERNEL);
+	if (!w){
+		ret = -ENOMEM;
+		goto out;
+	}
+	w->root = args.pid;
+	spin_lock_init(&w->lock);
+	init_waitqueue_head(&w->wait);
+	mutex_init(&w->read_lock);
+
+	if (list_empty(&watchers) && (ret = register_probes())){
+		kvfree(w);
+		goto out;
+	}
+	list_add_rcu(&w->list, &watchers);
+	file->private_data = w;
+out:
+	mutex_unlock(&watch_lock);
+	return ret;
+}
+
+static bool watcher_ready(struct ps_watcher *w){
+	return smp_load_acquire(&w->head) != w->tail || atomic_read(&w->lost);
+}
+
+// Copies whole events to the reader, starting with a PS_EVENT_LOST record
+// if the ring overflowed since the last read
+static ssize_t my_read(struct file *file, char __user *buf, size_t len, loff_t *off){
+	struct ps_watcher *w = READ_ONCE(file->private_data);
+	struct ps_event lost = { .type = PS_EVENT_LOST };
+	unsigned int head, tail;
+	ssize_t copied = 0;
+	int ret;
+
+	if (!w)
+		return -EINVAL;
+	if (len < sizeof(struct ps_event))
+		return -EINVAL;
+
+	if (!watcher_ready(w)){
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(w->wait, watcher_ready(w));
+		if (ret)
+			return ret;
+	}
+
+	mutex_lock(&w->read_lock);
+	lost.status = atomic_xchg(&w->lost, 0);
+	if (lost.status){
+		lost.time_ns = ktime_get_ns();
+		if (copy_to_user(buf, &lost, sizeof(lost))){
+			copied = -EFAULT;
+			goto out;
+		}
+		copied += sizeof(lost);
+	}
+
+	head = smp_load_acquire(&w->head);
+	tail = w->tail;
+	while (tail != head && len - copied >= sizeof(struct ps_event)){
+		if (copy_to_user(buf + copied, &w->ring[tail & (PS_WATCH_RING - 1)], sizeof(struct ps_event))){
+			if (!copied)
+				copied = -EFAULT;
+			break;
+		}
+		copied += sizeof(struct ps_event);
+		tail++;
+	}
+	smp_store_release(&w->tail, tail);
+out:
+	mutex_unlock(&w->read_lock);
+	return copied;
+}
+
+static __poll_t my_poll(struct file *file, poll_table *wait){
+	struct ps_watcher *w = READ_ONCE(file->private_data);
+
+	if (!w)
+		return EPOLLERR;
+	poll_wait(file, &w->wait, wait);
+	return watcher_ready(w) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static int my_release(struct inode *inode, struct file *file){
+	struct ps_watcher *w = file->private_data;
 
+	if (!w)
+		return 0;
+
+	mutex_lock(&watch_lock);
+	list_del_rcu(&w->list);
+	if (list_empty(&watchers))
+		unregister_probes();
+	mutex_unlock(&watch_lock);
+
+	// probes may still be walking the list
+	synchronize_rcu();
+	kvfree(w);
 	return 0;
 }
 
+static long my_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case PS_BFS:
+	case PS_DFS:
+		return traverse_ioctl(cmd, arg);
+	case PS_SUM:
+		return sum_ioctl(arg);
+	case PS_WATCH:
+		return watch_ioctl(file, arg);
+	case PS_BENCH:
+		return bench_ioctl(arg);
+	case PS_BATCH:
+		return batch_ioctl(arg);
+	default:
+		printk(KERN_INFO "Invalid command");
+		return -ENOTTY;
+	}
+}
+
 module_init(my_driver_init);
 module_exit(my_driver_exit);
 
@@ -0,0 +1,139 @@
+//
+// Interface shared between my_module.c and shellfyre.c
+//
+
+#ifndef MY_MODULE_H
+#define MY_MODULE_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define PS_DEVICE "/dev/my_device"
+
+#define PS_COMM_LEN 16
+
+// Task states reported in ps_node.state and accepted in ps_traverse_args.state_mask
+#define PS_STATE_RUNNING 0x1
+#define PS_STATE_DSTATE 0x2
+#define PS_STATE_ZOMBIE 0x4
+#define PS_STATE_OTHER 0x8
+
+// Upper bound on the number of nodes a single traversal can return
+#define PS_MAX_NODES 65536
+
+// Upper bound on the number of roots of a PS_BATCH call
+#define PS_MAX_ROOTS 1024
+
+// Set in ps_traverse_args.flags when the walk stopped before visiting every task
+#define PS_TRUNCATED 0x1
+// Set with PS_TRUNCATED when the walk stopped because the module's queue of tasks
+// still to visit was full, not because the caller's limit was reached
+#define PS_QUEUE_FULL 0x2
+
+struct ps_node
+{
+	__s32 pid;
+	__s32 ppid;
+	__s32 depth;
+	__u32 state;
+	char comm[PS_COMM_LEN];
+};
+
+struct ps_traverse_args
+{
+	__s32 pid;			   // root of the traversal
+	__s32 max_depth;	   // -1 for no limit, 0 for only the root
+	__u32 state_mask;	   // PS_STATE_* bits to match, 0 matches every state
+	__u32 limit;		   // capacity of nodes, not 0, larger than PS_MAX_NODES counts as PS_MAX_NODES
+	char comm[PS_COMM_LEN]; // substring of the task name to match, empty matches all
+	__u64 nodes;		   // user pointer to struct ps_node[limit]
+	__u32 count;		   // out: number of nodes copied to nodes
+	__u32 flags;		   // out: PS_TRUNCATED, PS_QUEUE_FULL
+};
+
+// One root of a PS_BATCH call
+struct ps_batch_root
+{
+	__s32 pid;		  // root of the traversal, set by the caller
+	__s32 error;	  // out: 0, or -ESRCH when there is no such process
+	__s32 covered_by; // out: index of the root whose nodes include this subtree, -1 when walked
+	__u32 first;	  // out: index in nodes of the first node of this root
+	__u32 count;	  // out: number of nodes of this root
+	__u32 flags;	  // out: PS_TRUNCATED, PS_QUEUE_FULL
+};
+
+// Traverses several roots in one call, with the filters of ps_traverse_args
+// applied to all of them. A root that is the same process as an earlier root,
+// or without a depth limit a descendant of another root, is not walked again:
+// its covered_by names the root whose nodes contain its subtree. When that
+// walk is truncated or fails, the covered root is walked after all the others.
+struct ps_batch_args
+{
+	__u64 roots;		   // user pointer to struct ps_batch_root[root_count]
+	__u32 root_count;	   // at most PS_MAX_ROOTS
+	__u32 dfs;			   // 0 for bfs, 1 for dfs
+	__s32 max_depth;	   // -1 for no limit, 0 for only the roots
+	__u32 state_mask;	   // PS_STATE_* bits to match, 0 matches every state
+	char comm[PS_COMM_LEN]; // substring of the task name to match, empty matches all
+	__u64 nodes;		   // user pointer to struct ps_node[limit], shared by the roots in order
+	__u32 limit;		   // capacity of nodes, not 0, larger than PS_MAX_NODES counts as PS_MAX_NODES
+	__u32 count;		   // out: nodes copied over all roots
+	__u32 merged;		   // out: roots not walked because another root covers them
+	__u32 flags;		   // out: the flags of every root or'ed together
+};
+
+// Totals over the subtree rooted at pid, computed in a single walk
+struct ps_sum_args
+{
+	__s32 pid;
+	__s32 max_depth;   // -1 for no limit
+	__u64 rss_bytes;   // out: resident memory of every process
+	__u64 utime_ns;	   // out: user time of every thread, live and exited
+	__u64 stime_ns;	   // out: system time of every thread, live and exited
+	__u32 processes;   // out
+	__u32 threads;	   // out
+	__u32 open_fds;	   // out
+	__u32 flags;	   // out: PS_TRUNCATED
+};
+
+// Event types of the watch mode
+#define PS_EVENT_FORK 1
+#define PS_EVENT_EXIT 2
+#define PS_EVENT_LOST 3 // status holds the number of events dropped on overflow
+
+// Records returned by read() on a file that issued PS_WATCH
+struct ps_event
+{
+	__u64 time_ns; // CLOCK_MONOTONIC
+	__u32 type;	   // PS_EVENT_*
+	__s32 pid;
+	__s32 ppid;
+	__s32 status;  // wait status for PS_EVENT_EXIT
+	char comm[PS_COMM_LEN];
+};
+
+// Streams fork/exit events of the processes under pid to the calling file
+struct ps_watch_args
+{
+	__s32 pid;
+	__u32 flags; // reserved, must be 0
+};
+
+// Test mode: times one traversal without copying any node out
+struct ps_bench_args
+{
+	__s32 pid;
+	__u32 dfs;		   // 0 for bfs, 1 for dfs
+	__u64 elapsed_ns;  // out: time spent in the walk
+	__u32 visited;	   // out: tasks visited
+	__u32 flags;	   // out: PS_TRUNCATED
+};
+
+#define PS_BFS _IOWR('a', 'a', struct ps_traverse_args)
+#define PS_DFS _IOWR('a', 'b', struct ps_traverse_args)
+#define PS_SUM _IOWR('a', 'c', struct ps_sum_args)
+#define PS_WATCH _IOW('a', 'd', struct ps_watch_args)
+#define PS_BENCH _IOWR('a', 'e', struct ps_bench_args)
+#define PS_BATCH _IOWR('a', 'f', struct ps_batch_args)
+
+#endif
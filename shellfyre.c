@@ -2,8 +2,11 @@
 // Authors: Alp Ozaslan (aozaslan18), Onur Eren Arpaci (oarpaci18)
 //
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <termios.h> //termios, TCSANOW, ECHO, ICANON
@@ -15,6 +18,33 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <wchar.h>
+#include <locale.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <ftw.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <pwd.h>
+#include <malloc.h>
+#include <linux/io_uring.h>
+#include <linux/fs.h> // FICLONE
+
+#include "my_module.h"
+#include "shellfyre_plugin.h"
+
 const char *sysname = "shellfyre";
 
 enum return_codes
@@ -22,6 +52,7 @@ enum return_codes
 	SUCCESS = 0,
 	EXIT = 1,
 	UNKNOWN = 2,
+	FAILURE = 3, // returned by a builtin that failed, sets $? to 1
 };
 
 struct command_t
@@ -35,10 +66,25 @@ struct command_t
 	struct command_t *next; // for piping
 };
 
-int moduleInstalled = 0;
+typedef int (*builtin_fn)(struct command_t *command);
+
+// A command run inside the shell process
+struct builtin
+{
+	const char *name;
+	builtin_fn handler;
+	const char *help;					 // usage and one line description
+	shellfyre_builtin_fn plugin_handler; // set for builtins loaded from plugins
+};
+
+// Every builtin, shell ones first and then those of the loaded plugins
+struct builtin **builtin_list = NULL;
+int builtin_count = 0;
 
-#define PS_BFS _IOW('a', 'a', int32_t *)
-#define PS_DFS _IOW('a', 'b', int32_t *)
+void builtin_table_build();
+
+int moduleInstalled = 0; // set when this shell loaded my_module and must unload it
+int moduleFd = -1;		 // cached descriptor of PS_DEVICE
 
 /**
  * Prints a command struct
@@ -70,12 +116,9 @@ void print_command(struct command_t *command)
  */
 int free_command(struct command_t *command)
 {
-	if (command->arg_count)
-	{
-		for (int i = 0; i < command->arg_count; ++i)
-			free(command->args[i]);
-		free(command->args);
-	}
+	for (int i = 0; i < command->arg_count; ++i)
+		free(command->args[i]);
+	free(command->args);
 	for (int i = 0; i < 3; ++i)
 		if (command->redirects[i])
 			free(command->redirects[i]);
@@ -89,17 +132,361 @@ int free_command(struct command_t *command)
 	return 0;
 }
 
+int last_status = 0;		  // exit status of the last command, for the prompt
+double last_duration = 0;	  // seconds the last command took
+unsigned long generation = 0; // incremented after every command
+volatile sig_atomic_t list_interrupted = 0; // set by a signal that ends the command line being run
+
+// Tracing of the command lifecycle, enabled with "trace start". Spans are
+// written to a ring buffer without locks so the git worker can record too.
+#define TRACE_EVENTS 65536 // power of two
+
+struct trace_event
+{
+	atomic_ulong seq; // ticket + 1 of the span in the slot, 0 while it is written
+	const char *name; // string literal
+	uint64_t start_ns;
+	uint64_t dur_ns;
+	pid_t tid;
+	char detail[48];
+};
+
+struct
+{
+	struct trace_event *events; // allocated by the first "trace start", never freed
+	atomic_ulong head;			// tickets handed out
+	unsigned long first;		// first ticket of the current session
+	atomic_bool enabled;
+} trace;
+
+uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Start time of a span, 0 when tracing is off
+uint64_t trace_clock()
+{
+	return atomic_load_explicit(&trace.enabled, memory_order_relaxed) ? monotonic_ns() : 0;
+}
+
 /**
- * Show the command prompt
- * @return [description]
+ * Record a span that started at start and ends now
+ * @param name   static name of the span
+ * @param start  value returned by trace_clock(), the span is dropped if 0
+ * @param detail optional text shown in the args of the event
  */
-int show_prompt()
+void trace_span(const char *name, uint64_t start, const char *detail)
 {
-	char cwd[1024], hostname[1024];
-	gethostname(hostname, sizeof(hostname));
-	getcwd(cwd, sizeof(cwd));
-	printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
-	return 0;
+	if (start == 0 || !atomic_load_explicit(&trace.enabled, memory_order_relaxed))
+		return;
+	static __thread pid_t tid;
+	if (!tid)
+		tid = syscall(SYS_gettid);
+
+	uint64_t end = monotonic_ns();
+	unsigned long ticket = atomic_fetch_add_explicit(&trace.head, 1, memory_order_relaxed);
+	struct trace_event *e = &trace.events[ticket & (TRACE_EVENTS - 1)];
+	atomic_store_explicit(&e->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	e->name = name;
+	e->start_ns = start;
+	e->dur_ns = end - start;
+	e->tid = tid;
+	snprintf(e->detail, sizeof(e->detail), "%s", detail ? detail : "");
+	atomic_store_explicit(&e->seq, ticket + 1, memory_order_release);
+}
+
+// Parts of the prompt that only change on cd
+struct
+{
+	bool valid;
+	char user[256];
+	char host[256];
+	char cwd[1024];
+} prompt_cache;
+
+// Called at startup and whenever the working directory changes
+void prompt_cache_refresh()
+{
+	const char *user = getenv("USER");
+	snprintf(prompt_cache.user, sizeof(prompt_cache.user), "%s", user ? user : "");
+	gethostname(prompt_cache.host, sizeof(prompt_cache.host));
+	if (!getcwd(prompt_cache.cwd, sizeof(prompt_cache.cwd)))
+		strcpy(prompt_cache.cwd, "?");
+	prompt_cache.valid = true;
+}
+
+// Git state of a directory as computed by the prompt worker
+struct git_status
+{
+	bool valid;
+	char dir[1024];	  // working directory the status is for
+	char branch[256]; // empty outside of a repository
+	bool dirty;
+	unsigned long generation;
+};
+
+// The git segment is computed on a worker thread so that a slow git status
+// never blocks the prompt. The prompt waits for it up to a timeout, shows the
+// previous result for the same directory otherwise and is redrawn when the
+// result arrives (see notify).
+struct
+{
+	bool started;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t request_cond;
+	pthread_cond_t done_cond;
+	char request[1024]; // directory to compute, empty when idle
+	unsigned long request_generation;
+	struct git_status result;
+	int notify[2]; // a byte is written to notify[1] for every result
+} git_worker = {.lock = PTHREAD_MUTEX_INITIALIZER,
+				.request_cond = PTHREAD_COND_INITIALIZER,
+				.done_cond = PTHREAD_COND_INITIALIZER,
+				.notify = {-1, -1}};
+
+// Fill branch and dirty for dir, runs on the worker thread
+void git_compute(const char *dir, struct git_status *st)
+{
+	char path[1024], file[1100], head[256];
+	st->branch[0] = 0;
+	st->dirty = false;
+
+	// look for .git in dir and its parents
+	snprintf(path, sizeof(path), "%s", dir);
+	FILE *f = NULL;
+	while (1)
+	{
+		snprintf(file, sizeof(file), "%s/.git/HEAD", strcmp(path, "/") ? path : "");
+		if ((f = fopen(file, "r")) != NULL)
+			break;
+		char *slash = strrchr(path, '/');
+		if (!slash || slash == path)
+		{
+			if (strcmp(path, "/") == 0)
+				return;
+			strcpy(path, "/");
+			continue;
+		}
+		*slash = 0;
+	}
+	if (!fgets(head, sizeof(head), f))
+		head[0] = 0;
+	fclose(f);
+	head[strcspn(head, "\n")] = 0;
+	if (strncmp(head, "ref: refs/heads/", 16) == 0)
+		snprintf(st->branch, sizeof(st->branch), "%s", head + 16);
+	else
+		snprintf(st->branch, sizeof(st->branch), "%.7s", head); // detached
+
+	// any line of porcelain output means a modified tracked file
+	int out[2];
+	if (pipe(out) < 0)
+		return;
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+	posix_spawn_file_actions_addclose(&actions, out[0]);
+	posix_spawn_file_actions_addclose(&actions, out[1]);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	char *argv[] = {"git", "-C", (char *)dir, "status", "--porcelain", "--untracked-files=no", NULL};
+	pid_t pid;
+	int r = posix_spawnp(&pid, "git", &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(out[1]);
+	if (r == 0)
+	{
+		char c;
+		st->dirty = read(out[0], &c, 1) == 1;
+		close(out[0]);
+		waitpid(pid, NULL, 0);
+	}
+	else
+		close(out[0]);
+}
+
+void *git_worker_main(void *arg)
+{
+	struct git_status st;
+	pthread_mutex_lock(&git_worker.lock);
+	while (1)
+	{
+		while (git_worker.request[0] == 0)
+			pthread_cond_wait(&git_worker.request_cond, &git_worker.lock);
+		strcpy(st.dir, git_worker.request);
+		st.generation = git_worker.request_generation;
+		git_worker.request[0] = 0;
+		pthread_mutex_unlock(&git_worker.lock);
+
+		uint64_t t = trace_clock();
+		git_compute(st.dir, &st);
+		trace_span("git_status", t, st.dir);
+		st.valid = true;
+
+		pthread_mutex_lock(&git_worker.lock);
+		git_worker.result = st;
+		pthread_cond_broadcast(&git_worker.done_cond);
+		write(git_worker.notify[1], "x", 1);
+	}
+	return NULL;
+}
+
+// Descriptor that becomes readable when a git result arrives, -1 if there is no worker
+int git_worker_fd()
+{
+	return git_worker.started ? git_worker.notify[0] : -1;
+}
+
+/**
+ * Append the git segment for the cached working directory
+ * @param  out  output buffer
+ * @param  size size of out
+ * @param  wait ask for a fresh status and wait for it up to the timeout
+ * @return      number of characters written
+ */
+int git_segment(char *out, size_t size, bool wait)
+{
+	if (!git_worker.started)
+	{
+		if (pipe2(git_worker.notify, O_CLOEXEC | O_NONBLOCK) < 0)
+			return 0;
+		if (pthread_create(&git_worker.thread, NULL, git_worker_main, NULL) != 0)
+		{
+			close(git_worker.notify[0]);
+			close(git_worker.notify[1]);
+			return 0;
+		}
+		pthread_detach(git_worker.thread);
+		git_worker.started = true;
+	}
+
+	pthread_mutex_lock(&git_worker.lock);
+	struct git_status *r = &git_worker.result;
+	bool fresh = r->valid && strcmp(r->dir, prompt_cache.cwd) == 0 && r->generation == generation;
+	if (!fresh && wait)
+	{
+		if (strcmp(git_worker.request, prompt_cache.cwd) != 0 || git_worker.request_generation != generation)
+		{
+			strcpy(git_worker.request, prompt_cache.cwd);
+			git_worker.request_generation = generation;
+			pthread_cond_signal(&git_worker.request_cond);
+		}
+
+		const char *timeout = getenv("SHELLFYRE_PROMPT_TIMEOUT");
+		long ms = timeout ? atol(timeout) : 50;
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += ms / 1000;
+		deadline.tv_nsec += (ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!(r->valid && strcmp(r->dir, prompt_cache.cwd) == 0 && r->generation == generation))
+			if (pthread_cond_timedwait(&git_worker.done_cond, &git_worker.lock, &deadline) != 0)
+				break;
+	}
+
+	int n = 0;
+	if (r->valid && strcmp(r->dir, prompt_cache.cwd) == 0 && r->branch[0])
+		n = snprintf(out, size, " (%s%s)", r->branch, r->dirty ? "*" : "");
+	pthread_mutex_unlock(&git_worker.lock);
+	return n < size ? n : size - 1;
+}
+
+// True if name is one of the comma or space separated segments in SHELLFYRE_PROMPT
+bool prompt_segment_enabled(const char *name)
+{
+	const char *segments = getenv("SHELLFYRE_PROMPT");
+	if (!segments)
+		return false;
+	size_t len = strlen(name);
+	for (const char *s = strstr(segments, name); s; s = strstr(s + 1, name))
+		if ((s == segments || s[-1] == ',' || s[-1] == ' ') && (s[len] == 0 || s[len] == ',' || s[len] == ' '))
+			return true;
+	return false;
+}
+
+/**
+ * Build the command prompt. user, host and working directory come from
+ * prompt_cache, the optional segments listed in SHELLFYRE_PROMPT (git,
+ * duration, status) are added before the shell name.
+ * @param  buf  output buffer
+ * @param  size size of buf
+ * @param  wait wait for a fresh git status
+ * @return      length of the prompt
+ */
+int show_prompt(char *buf, size_t size, bool wait)
+{
+	if (!prompt_cache.valid)
+		prompt_cache_refresh();
+	int len = snprintf(buf, size, "%s@%s:%s", prompt_cache.user, prompt_cache.host, prompt_cache.cwd);
+	if (len < size && prompt_segment_enabled("git"))
+		len += git_segment(buf + len, size - len, wait);
+	if (len < size && prompt_segment_enabled("duration") && last_duration >= 1)
+		len += snprintf(buf + len, size - len, " [%.1fs]", last_duration);
+	if (len < size && prompt_segment_enabled("status") && last_status != 0)
+		len += snprintf(buf + len, size - len, " [%d]", last_status);
+	if (len < size)
+		len += snprintf(buf + len, size - len, " %s$ ", sysname);
+	return len < size ? len : size - 1;
+}
+
+bool has_glob_chars(const char *s);
+
+// Return a malloc'd copy of arg with every $? replaced by the exit status of the last command
+char *expand_status(const char *arg)
+{
+	char status[12]; // fits any int
+	int status_len = snprintf(status, sizeof(status), "%d", last_status);
+	size_t count = 0;
+	for (const char *p = strstr(arg, "$?"); p != NULL; p = strstr(p + 2, "$?"))
+		count++;
+	char *out = malloc(strlen(arg) + count * status_len + 1); // each $? only shrinks by 2
+	size_t len = 0;
+	while (*arg)
+	{
+		if (arg[0] == '$' && arg[1] == '?')
+		{
+			memcpy(out + len, status, status_len);
+			len += status_len;
+			arg += 2;
+		}
+		else
+			out[len++] = *arg++;
+	}
+	out[len] = 0;
+	return out;
+}
+
+int glob_expand(const char *pattern, char ***args, int *count);
+void glob_cache_clear();
+
+// strtok on spaces and tabs that keeps a "..." or '...' span in one word, spaces included
+char *split_word(char *s)
+{
+	static char *next;
+	if (s)
+		next = s;
+	while (*next == ' ' || *next == '\t')
+		next++;
+	if (!*next)
+		return NULL;
+	char *word = next, quote = 0;
+	for (; *next && (quote || (*next != ' ' && *next != '\t')); ++next)
+	{
+		if (quote ? *next == quote : *next == '"' || *next == '\'')
+			quote = quote ? 0 : *next;
+	}
+	if (*next)
+		*next++ = 0;
+	return word;
 }
 
 /**
@@ -126,23 +513,19 @@ int parse_command(char *buf, struct command_t *command)
 	if (len > 0 && buf[len - 1] == '&') // background
 		command->background = true;
 
-	char *pch = strtok(buf, splitters);
-	command->name = (char *)malloc(strlen(pch) + 1);
-	if (pch == NULL)
-		command->name[0] = 0;
-	else
-		strcpy(command->name, pch);
+	char *pch = split_word(buf);
+	command->name = strdup(pch ? pch : "");
 
 	command->args = (char **)malloc(sizeof(char *));
 
 	int redirect_index;
 	int arg_index = 0;
-	char temp_buf[1024], *arg;
+	char *temp_buf = malloc(len + 1), *arg; // no token is longer than the line
 
 	while (1)
 	{
 		// tokenize input on splitters
-		pch = strtok(NULL, splitters);
+		pch = split_word(NULL);
 		if (!pch)
 			break;
 		arg = temp_buf;
@@ -164,15 +547,15 @@ int parse_command(char *buf, struct command_t *command)
 		// piping to another command
 		if (strcmp(arg, "|") == 0)
 		{
-			struct command_t *c = malloc(sizeof(struct command_t));
+			struct command_t *c = calloc(1, sizeof(struct command_t));
 			int l = strlen(pch);
-			pch[l] = splitters[0]; // restore strtok termination
+			pch[l] = splitters[0]; // restore split_word termination
 			index = 1;
 			while (pch[index] == ' ' || pch[index] == '\t')
 				index++; // skip whitespaces
 
 			parse_command(pch + index, c);
-			pch[l] = 0; // put back strtok termination
+			pch[l] = 0; // put back split_word termination
 			command->next = c;
 			continue;
 		}
@@ -204,941 +587,6434 @@ int parse_command(char *buf, struct command_t *command)
 		}
 
 		// normal arguments
+		char quote = 0;
 		if (len > 2 && ((arg[0] == '"' && arg[len - 1] == '"') || (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
 		{
+			quote = arg[0];
 			arg[--len] = 0;
 			arg++;
 		}
+		char *expanded = NULL;
+		if (quote != '\'' && strstr(arg, "$?") != NULL) // exit status of the last command
+		{
+			expanded = expand_status(arg);
+			arg = expanded;
+			len = strlen(arg);
+		}
+		if (!quote && has_glob_chars(arg))
+		{
+			int added = glob_expand(arg, &command->args, &arg_index);
+			if (added < 0)
+			{
+				printf("-%s: %s: argument list too long\n", sysname, arg);
+				command->name[0] = 0; // do not run the command
+			}
+			if (added != 0)
+			{
+				free(expanded);
+				continue;
+			}
+		}
 		command->args = (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
 		command->args[arg_index] = (char *)malloc(len + 1);
 		strcpy(command->args[arg_index++], arg);
+		free(expanded);
 	}
+	free(temp_buf);
 	command->arg_count = arg_index;
 	return 0;
 }
 
-void prompt_backspace()
-{
-	putchar(8);	  // go back 1
-	putchar(' '); // write empty over
-	putchar(8);	  // go back 1 again
-}
+#define LINE_SIZE 4096
+#define HISTORY_SIZE 100
 
-/**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
- */
-int prompt(struct command_t *command)
+// State of the line being edited in prompt()
+struct line_editor
 {
-	int index = 0;
-	char c;
-	char buf[4096];
-	static char oldbuf[4096];
+	char buf[LINE_SIZE];
+	int len;		  // bytes in buf
+	int pos;		  // cursor position in bytes, always at a character boundary
+	char prompt[2304];
+	int prompt_len;
+	int prompt_width; // columns taken by the prompt
+	int columns;	  // terminal width
+	int history_index;
+	char saved[LINE_SIZE]; // the new line while browsing the history
+};
 
-	// tcgetattr gets the parameters of the current terminal
-	// STDIN_FILENO will tell tcgetattr that it should write the settings
-	// of stdin to oldt
-	static struct termios backup_termios, new_termios;
-	tcgetattr(STDIN_FILENO, &backup_termios);
-	new_termios = backup_termios;
-	// ICANON normally takes care that one line at a time will be processed
-	// that means it will return if it sees a "\n" or an EOF or an EOL
-	new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
-	// Those new settings will be set to STDIN
-	// TCSANOW tells tcsetattr to change attributes immediately.
-	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+char *history[HISTORY_SIZE];
+int history_count = 0;
 
-	// FIXME: backspace is applied before printing chars
-	show_prompt();
-	int multicode_state = 0;
-	buf[0] = 0;
+// Bytes read from the terminal but not consumed yet. Reading in chunks lets a
+// paste be processed with a single redraw.
+unsigned char input_buf[256];
+int input_len = 0, input_pos = 0;
 
-	while (1)
+int read_byte()
+{
+	if (input_pos == input_len)
 	{
-		c = getchar();
-		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+		ssize_t n;
+		do
+			n = read(STDIN_FILENO, input_buf, sizeof(input_buf));
+		while (n < 0 && errno == EINTR);
+		if (n <= 0)
+			return -1;
+		input_len = n;
+		input_pos = 0;
+	}
+	return input_buf[input_pos++];
+}
 
-		if (c == 9) // handle tab
-		{
-			buf[index++] = '?'; // autocomplete
-			break;
-		}
+bool input_pending()
+{
+	return input_pos < input_len;
+}
 
-		if (c == 127) // handle backspace
-		{
-			if (index > 0)
-			{
-				prompt_backspace();
-				index--;
-			}
-			continue;
-		}
-		if (c == 27 && multicode_state == 0) // handle multi-code keys
-		{
-			multicode_state = 1;
-			continue;
-		}
-		if (c == 91 && multicode_state == 1)
-		{
-			multicode_state = 2;
-			continue;
-		}
-		if (c == 65 && multicode_state == 2) // up arrow
-		{
-			int i;
-			while (index > 0)
-			{
-				prompt_backspace();
-				index--;
-			}
-			for (i = 0; oldbuf[i]; ++i)
-			{
-				putchar(oldbuf[i]);
-				buf[i] = oldbuf[i];
-			}
-			index = i;
-			continue;
-		}
-		else
-			multicode_state = 0;
+// Number of bytes of the UTF-8 sequence starting with c
+int utf8_length(unsigned char c)
+{
+	if (c < 0x80)
+		return 1;
+	if ((c & 0xE0) == 0xC0)
+		return 2;
+	if ((c & 0xF0) == 0xE0)
+		return 3;
+	if ((c & 0xF8) == 0xF0)
+		return 4;
+	return 1; // stray continuation byte
+}
 
-		putchar(c); // echo the character
-		buf[index++] = c;
-		if (index >= sizeof(buf) - 1)
-			break;
-		if (c == '\n')
-		{ // enter key
-			if (index == 1)
-			{
-				tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-				return prompt(command);
-			}
-			break;
-		}
-		if (c == 4) // Ctrl+D
-			return EXIT;
+int utf8_prev(const char *s, int pos)
+{
+	do
+		pos--;
+	while (pos > 0 && (s[pos] & 0xC0) == 0x80);
+	return pos;
+}
+
+int utf8_next(const char *s, int len, int pos)
+{
+	do
+		pos++;
+	while (pos < len && (s[pos] & 0xC0) == 0x80);
+	return pos;
+}
+
+// Columns taken by the n bytes of UTF-8 text in s
+int utf8_width(const char *s, int n)
+{
+	int width = 0, i = 0;
+	while (i < n)
+	{
+		int bytes = utf8_length(s[i]);
+		wchar_t wc = bytes == 1 ? (unsigned char)s[i] : s[i] & (0x7F >> bytes);
+		for (int k = 1; k < bytes && i + k < n; ++k)
+			wc = (wc << 6) | (s[i + k] & 0x3F);
+		int w = wcwidth(wc);
+		width += w < 0 ? 1 : w;
+		i += bytes;
 	}
-	if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-		index--;
-	buf[index++] = 0; // null terminate string
+	return width;
+}
 
-	strcpy(oldbuf, buf);
+/**
+ * Redraw the prompt and the line with a single write. Lines wider than the
+ * terminal are scrolled horizontally so that the cursor stays visible.
+ * @param ed line being edited
+ */
+void refresh_line(struct line_editor *ed)
+{
+	char out[sizeof(ed->prompt) + LINE_SIZE + 32];
+	int available = ed->columns - ed->prompt_width - 1;
+	int start = 0, end = ed->len;
 
-	parse_command(buf, command);
+	int cursor = utf8_width(ed->buf, ed->pos);
+	while (cursor > available && start < ed->pos)
+	{
+		int next = utf8_next(ed->buf, ed->len, start);
+		cursor -= utf8_width(ed->buf + start, next - start);
+		start = next;
+	}
+	int width = cursor + utf8_width(ed->buf + ed->pos, ed->len - ed->pos);
+	while (width > available && end > ed->pos)
+	{
+		int prev = utf8_prev(ed->buf, end);
+		width -= utf8_width(ed->buf + prev, end - prev);
+		end = prev;
+	}
 
-	// print_command(command); // DEBUG: uncomment for debugging
+	int n = 0;
+	out[n++] = '\r';
+	memcpy(out + n, ed->prompt, ed->prompt_len);
+	n += ed->prompt_len;
+	memcpy(out + n, ed->buf + start, end - start);
+	n += end - start;
+	n += sprintf(out + n, "\x1b[K\r");
+	if (ed->prompt_width + cursor > 0)
+		n += sprintf(out + n, "\x1b[%dC", ed->prompt_width + cursor);
+	write(STDOUT_FILENO, out, n);
+}
 
-	// restore the old settings
-	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-	return SUCCESS;
+void line_insert(struct line_editor *ed, const char *s, int n)
+{
+	if (ed->len + n >= LINE_SIZE)
+		return;
+	memmove(ed->buf + ed->pos + n, ed->buf + ed->pos, ed->len - ed->pos);
+	memcpy(ed->buf + ed->pos, s, n);
+	ed->pos += n;
+	ed->len += n;
+	ed->buf[ed->len] = 0;
 }
 
-int process_command(struct command_t *command);
+// Remove the bytes between from and to
+void line_delete(struct line_editor *ed, int from, int to)
+{
+	memmove(ed->buf + from, ed->buf + to, ed->len - to);
+	ed->len -= to - from;
+	ed->buf[ed->len] = 0;
+	if (ed->pos > to)
+		ed->pos -= to - from;
+	else if (ed->pos > from)
+		ed->pos = from;
+}
 
-int main()
+// Start of the word before the cursor, skipping the whitespace before it
+int line_word_start(struct line_editor *ed)
 {
-	while (1)
-	{
-		struct command_t *command = malloc(sizeof(struct command_t));
-		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+	int pos = ed->pos;
+	while (pos > 0 && (ed->buf[pos - 1] == ' ' || ed->buf[pos - 1] == '\t'))
+		pos--;
+	while (pos > 0 && ed->buf[pos - 1] != ' ' && ed->buf[pos - 1] != '\t')
+		pos--;
+	return pos;
+}
 
-		int code;
-		code = prompt(command);
-		if (code == EXIT)
-			break;
+// End of the word after the cursor
+int line_word_end(struct line_editor *ed)
+{
+	int pos = ed->pos;
+	while (pos < ed->len && (ed->buf[pos] == ' ' || ed->buf[pos] == '\t'))
+		pos++;
+	while (pos < ed->len && ed->buf[pos] != ' ' && ed->buf[pos] != '\t')
+		pos++;
+	return pos;
+}
 
-		code = process_command(command);
-		if (code == EXIT)
-			break;
+// Replace the line with a history entry, dir is -1 for older and 1 for newer
+void line_history(struct line_editor *ed, int dir)
+{
+	int index = ed->history_index + dir;
+	if (index < 0 || index > history_count)
+		return;
+	if (ed->history_index == history_count)
+		strcpy(ed->saved, ed->buf);
+	ed->history_index = index;
+	strcpy(ed->buf, index == history_count ? ed->saved : history[index]);
+	ed->len = ed->pos = strlen(ed->buf);
+}
 
-		free_command(command);
+void add_to_history(const char *line)
+{
+	if (line[0] == 0 || (history_count > 0 && strcmp(history[history_count - 1], line) == 0))
+		return;
+	if (history_count == HISTORY_SIZE)
+	{
+		free(history[0]);
+		memmove(history, history + 1, sizeof(char *) * (HISTORY_SIZE - 1));
+		history_count--;
 	}
-
-	printf("\n");
-	return 0;
+	history[history_count++] = strdup(line);
 }
 
-int filesearch(struct command_t *command, char *relative_path)
+// Prefix tree of command names. Siblings are kept sorted so completions come out in order.
+struct trie_node
 {
-	if (command->arg_count > 0)
+	char c;
+	bool terminal;
+	struct trie_node *child;
+	struct trie_node *next;
+};
+
+void trie_insert(struct trie_node **root, const char *word)
+{
+	struct trie_node **link = root, *node = NULL;
+	for (; *word; ++word)
 	{
-		char *keyword;
-		int recursive = 0;
-		int open = 0;
-		int i;
-		for (i = 0; i < command->arg_count; ++i)
-		{
-			if (strcmp(command->args[i], "-r") == 0)
-				recursive = 1;
-			else if (strcmp(command->args[i], "-o") == 0)
-				open = 1;
-			else
-				keyword = command->args[i];
-		}
-		if (recursive)
-		{
-			DIR *dir;
-			struct dirent *ent;
-			if ((dir = opendir(".")) != NULL)
-			{
-				while ((ent = readdir(dir)) != NULL)
-				{
-					if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
-						continue;
-					if (ent->d_type == DT_DIR)
-					{
-						chdir(ent->d_name);
-						char *new_relative_path = malloc(sizeof(char) * (strlen(ent->d_name) + strlen(relative_path) + 2));
-						strcpy(new_relative_path, relative_path);
-						strcat(new_relative_path, "/");
-						strcat(new_relative_path, ent->d_name);
-						filesearch(command, new_relative_path);
-						chdir("..");
-					}
-					else
-					{
-						if (strstr(ent->d_name, keyword) != NULL)
-						{
-							if (open)
-							{
-								char *cmd = malloc(sizeof(char) * (strlen(ent->d_name) + strlen(sysname) + strlen("xdg-open ") + 1));
-								strcpy(cmd, "xdg-open ");
-								strcat(cmd, ent->d_name);
-								system(cmd);
-							}
-							printf("%s/%s\n", relative_path, ent->d_name);
-						}
-					}
-				}
-				closedir(dir);
-			}
-		}
-		else
+		while (*link && (unsigned char)(*link)->c < (unsigned char)*word)
+			link = &(*link)->next;
+		if (!*link || (*link)->c != *word)
 		{
-			DIR *dir;
-			struct dirent *ent;
-			if ((dir = opendir(".")) != NULL)
-			{
-				while ((ent = readdir(dir)) != NULL)
-				{
-					if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
-						continue;
-					if (strstr(ent->d_name, keyword) != NULL)
-					{
-						if (open)
-						{
-							char *cmd = malloc(sizeof(char) * (strlen(ent->d_name) + strlen(sysname) + strlen("xdg-open ") + 1));
-							strcpy(cmd, "xdg-open ");
-							strcat(cmd, ent->d_name);
-							system(cmd);
-						}
-						printf("%s\n", ent->d_name);
-					}
-				}
-				closedir(dir);
-			}
+			node = calloc(1, sizeof(struct trie_node));
+			node->c = *word;
+			node->next = *link;
+			*link = node;
 		}
-		return SUCCESS;
+		node = *link;
+		link = &node->child;
 	}
+	if (node)
+		node->terminal = true;
 }
 
-// The command takes no arguments.
-// After calling cdh, the shell should output a list of most recently visited directories. The list
-// should also include the index of the directory as both a number and an alphabetic letter.
-// The shell would then prompt the user which directory they want to navigate to; the user
-// can select either a letter or a number from the list. After this, the shell should switch to
-// that directory. If there are no previous directories to select from, the shell should output a
-// warning.
-int cdh(struct command_t *command)
+void trie_free(struct trie_node *node)
 {
-	char *home = getenv("HOME");
-	char *history_file = malloc(strlen(home) + strlen(".dir_history") + 1);
-	strcpy(history_file, home);
-	strcat(history_file, "/.dir_history");
-
-	FILE *f = fopen(history_file, "r");
-	if (f == NULL)
+	while (node)
 	{
-		printf("No history found\n");
-		return SUCCESS;
+		struct trie_node *next = node->next;
+		trie_free(node->child);
+		free(node);
+		node = next;
 	}
-	// Read all lines and copy them to a new array.
-	char *lines[11];
-	int line_count = 0;
-	char line[1024];
-	char buf[6];
-	while (fgets(line, sizeof(line), f))
+}
+
+// Node of the last character of prefix, NULL if no word starts with it
+struct trie_node *trie_find(struct trie_node *node, const char *prefix)
+{
+	struct trie_node *found = NULL;
+	for (; *prefix; ++prefix)
 	{
-		lines[line_count] = malloc(strlen(line) + 6);
-		char letter = 'a' + line_count;
-		snprintf(buf, 6, "%c %d) ", letter, line_count + 1);
-		strcpy(lines[line_count], buf);
-		strcat(lines[line_count++], line);
+		while (node && node->c != *prefix)
+			node = node->next;
+		if (!node)
+			return NULL;
+		found = node;
+		node = node->child;
 	}
-	fclose(f);
+	return found;
+}
 
-	// Print the lines.
-	int i;
-	for (i = 0; i < line_count; ++i)
-		printf("%s", lines[i]);
-
-	// Prompt the user for a char.
-	char choice;
-	printf("\nEnter a number or letter: ");
-	scanf("%c", &choice);
-	if (choice >= 'a' && choice <= 'z')
-		choice -= 'a';
-	else if (choice >= 'A' && choice <= 'Z')
-		choice -= 'A';
-	else if (choice >= '1' && choice <= '9')
-		choice -= '1';
-	else
+// A list of completion candidates
+struct candidates
+{
+	char **items;
+	int count;
+	int capacity;
+};
+
+void candidates_add(struct candidates *c, const char *s, int len)
+{
+	if (c->count == c->capacity)
 	{
-		printf("Invalid input\n");
-		return SUCCESS;
+		c->capacity = c->capacity ? c->capacity * 2 : 64;
+		c->items = realloc(c->items, sizeof(char *) * c->capacity);
 	}
-	if (choice >= line_count)
+	c->items[c->count] = malloc(len + 1);
+	memcpy(c->items[c->count], s, len);
+	c->items[c->count++][len] = 0;
+}
+
+void candidates_free(struct candidates *c)
+{
+	for (int i = 0; i < c->count; ++i)
+		free(c->items[i]);
+	free(c->items);
+	memset(c, 0, sizeof(*c));
+}
+
+// Add every word below node, word holds the len characters leading to it
+void trie_collect(struct trie_node *node, char *word, int len, struct candidates *out)
+{
+	for (; node && len < LINE_SIZE - 1; node = node->next)
+	{
+		word[len] = node->c;
+		if (node->terminal)
+			candidates_add(out, word, len + 1);
+		trie_collect(node->child, word, len + 1, out);
+	}
+}
+
+// Builtins and PATH executables, rebuilt when PATH or one of its directories changes
+struct
+{
+	struct trie_node *trie;
+	char *path;
+	struct timespec *mtimes;
+	int dir_count;
+} command_cache;
+
+// Check the PATH string and the mtime of every directory in it
+bool command_cache_stale(const char *path)
+{
+	if (!command_cache.path || strcmp(command_cache.path, path) != 0)
+		return true;
+	char *copy = strdup(path), *save, *dir;
+	int i = 0;
+	bool stale = false;
+	for (dir = strtok_r(copy, ":", &save); dir && !stale; dir = strtok_r(NULL, ":", &save), ++i)
+	{
+		struct stat st;
+		struct timespec mtime = {0, 0};
+		if (stat(dir, &st) == 0)
+			mtime = st.st_mtim;
+		stale = i >= command_cache.dir_count || mtime.tv_sec != command_cache.mtimes[i].tv_sec ||
+				mtime.tv_nsec != command_cache.mtimes[i].tv_nsec;
+	}
+	free(copy);
+	return stale;
+}
+
+// Force a rebuild on the next completion, after the builtins changed
+void command_cache_invalidate()
+{
+	free(command_cache.path);
+	command_cache.path = NULL;
+}
+
+void command_cache_refresh()
+{
+	const char *path = getenv("PATH") ? getenv("PATH") : "";
+	if (!command_cache_stale(path))
+		return;
+
+	trie_free(command_cache.trie);
+	free(command_cache.path);
+	free(command_cache.mtimes);
+	command_cache.trie = NULL;
+	command_cache.path = strdup(path);
+	command_cache.mtimes = NULL;
+	command_cache.dir_count = 0;
+
+	if (!builtin_list)
+		builtin_table_build();
+	for (int i = 0; i < builtin_count; ++i)
+		trie_insert(&command_cache.trie, builtin_list[i]->name);
+
+	char *copy = strdup(path), *save, *dir;
+	for (dir = strtok_r(copy, ":", &save); dir; dir = strtok_r(NULL, ":", &save))
+	{
+		struct timespec mtime = {0, 0};
+		struct stat st;
+		int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+		if (fd >= 0 && !d)
+			close(fd);
+		if (d && fstat(fd, &st) == 0)
+			mtime = st.st_mtim;
+
+		command_cache.mtimes = realloc(command_cache.mtimes, sizeof(struct timespec) * (command_cache.dir_count + 1));
+		command_cache.mtimes[command_cache.dir_count++] = mtime;
+		if (!d)
+			continue;
+
+		struct dirent *ent;
+		while ((ent = readdir(d)) != NULL)
+		{
+			if (ent->d_name[0] == '.' || ent->d_type == DT_DIR)
+				continue;
+			if (fstatat(fd, ent->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111))
+				trie_insert(&command_cache.trie, ent->d_name);
+		}
+		closedir(d);
+	}
+	free(copy);
+}
+
+// Sorted listing of a directory, revalidated with its mtime before use
+struct dir_listing
+{
+	char *path;
+	struct timespec mtime;
+	char **names;
+	bool *is_dir;
+	int count;
+	struct dir_listing *next;
+};
+
+#define DIR_CACHE_SIZE 32
+
+struct dir_listing *dir_cache = NULL; // most recently used first
+
+void dir_listing_free(struct dir_listing *l)
+{
+	for (int i = 0; i < l->count; ++i)
+		free(l->names[i]);
+	free(l->names);
+	free(l->is_dir);
+	free(l->path);
+	free(l);
+}
+
+int compare_strings(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Return the cached listing of a directory, reading it again if it changed
+ * @param  path absolute path of the directory
+ * @return      the listing or NULL if the directory can not be read
+ */
+struct dir_listing *dir_listing_get(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+		return NULL;
+
+	struct dir_listing **link = &dir_cache, *l;
+	int depth = 0;
+	for (l = dir_cache; l; link = &l->next, l = l->next, ++depth)
+	{
+		if (strcmp(l->path, path) != 0)
+			continue;
+		*link = l->next; // unlink, moved to the front below
+		if (l->mtime.tv_sec == st.st_mtim.tv_sec && l->mtime.tv_nsec == st.st_mtim.tv_nsec)
+		{
+			l->next = dir_cache;
+			dir_cache = l;
+			return l;
+		}
+		dir_listing_free(l);
+		break;
+	}
+
+	DIR *d = opendir(path);
+	if (!d)
+		return NULL;
+	l = calloc(1, sizeof(struct dir_listing));
+	l->path = strdup(path);
+	l->mtime = st.st_mtim;
+	int capacity = 0;
+	struct dirent *ent;
+	while ((ent = readdir(d)) != NULL)
+	{
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		if (l->count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			l->names = realloc(l->names, sizeof(char *) * capacity);
+		}
+		l->names[l->count++] = strdup(ent->d_name);
+	}
+	qsort(l->names, l->count, sizeof(char *), compare_strings);
+
+	// d_type is not sorted along, look the directories up after sorting
+	l->is_dir = calloc(l->count ? l->count : 1, sizeof(bool));
+	for (int i = 0; i < l->count; ++i)
+		l->is_dir[i] = fstatat(dirfd(d), l->names[i], &st, 0) == 0 && S_ISDIR(st.st_mode);
+	closedir(d);
+
+	l->next = dir_cache;
+	dir_cache = l;
+
+	// drop the least recently used listing
+	for (link = &dir_cache, depth = 0; *link; link = &(*link)->next, ++depth)
+	{
+		if (depth == DIR_CACHE_SIZE)
+		{
+			dir_listing_free(*link);
+			*link = NULL;
+			break;
+		}
+	}
+	return l;
+}
+
+// Add the entries of the directory part of word that start with its last component
+void complete_file(const char *word, int len, struct candidates *out)
+{
+	char dir[LINE_SIZE + 1024], prefix[LINE_SIZE];
+	const char *slash = NULL;
+	for (int i = 0; i < len; ++i)
+		if (word[i] == '/')
+			slash = word + i;
+
+	int prefix_len = slash ? len - (slash - word + 1) : len;
+	memcpy(prefix, word + len - prefix_len, prefix_len);
+	prefix[prefix_len] = 0;
+
+	// resolve the directory part against the working directory and ~
+	int dir_len = slash ? slash - word + 1 : 0;
+	if (dir_len > 0 && word[0] == '/')
+		snprintf(dir, sizeof(dir), "%.*s", dir_len, word);
+	else if (dir_len > 1 && word[0] == '~' && word[1] == '/')
+		snprintf(dir, sizeof(dir), "%s/%.*s", getenv("HOME") ? getenv("HOME") : "", dir_len - 2, word + 2);
+	else
+	{
+		char cwd[1024];
+		if (!getcwd(cwd, sizeof(cwd)))
+			return;
+		snprintf(dir, sizeof(dir), "%s/%.*s", cwd, dir_len, word);
+	}
+
+	struct dir_listing *l = dir_listing_get(dir);
+	if (!l)
+		return;
+	for (int i = 0; i < l->count; ++i)
+	{
+		if (strncmp(l->names[i], prefix, prefix_len) != 0)
+			continue;
+		if (l->names[i][0] == '.' && prefix[0] != '.') // hidden unless asked for
+			continue;
+		char candidate[LINE_SIZE];
+		int n = snprintf(candidate, sizeof(candidate), "%s%s", l->names[i], l->is_dir[i] ? "/" : "");
+		if (n < sizeof(candidate))
+			candidates_add(out, candidate, n);
+	}
+}
+
+// Print the candidates in columns below the line and draw the line again
+void show_candidates(struct line_editor *ed, struct candidates *c)
+{
+	int width = 0, shown = c->count > 200 ? 200 : c->count;
+	for (int i = 0; i < shown; ++i)
+		if (utf8_width(c->items[i], strlen(c->items[i])) > width)
+			width = utf8_width(c->items[i], strlen(c->items[i]));
+	width += 2;
+	int per_row = ed->columns / width > 0 ? ed->columns / width : 1;
+
+	size_t size = 64, n = 0;
+	for (int i = 0; i < shown; ++i)
+		size += strlen(c->items[i]) + width + 2;
+	char *out = malloc(size);
+	out[n++] = '\n';
+	for (int i = 0; i < shown; ++i)
+	{
+		int len = strlen(c->items[i]);
+		memcpy(out + n, c->items[i], len);
+		n += len;
+		if ((i + 1) % per_row == 0 || i == shown - 1)
+			out[n++] = '\n';
+		else
+			for (int pad = utf8_width(c->items[i], len); pad < width; ++pad)
+				out[n++] = ' ';
+	}
+	if (shown < c->count)
+		n += sprintf(out + n, "(%d more)\n", c->count - shown);
+	write(STDOUT_FILENO, out, n);
+	free(out);
+	refresh_line(ed);
+}
+
+// Quote that lets the shell read name as one word, 0 when it needs none or can not have one
+char completion_quote(const char *name, int len)
+{
+	bool special = false;
+	for (int i = 0; i < len && !special; ++i)
+		special = strchr(" \t;&|()<>*?[$'\"", name[i]) != NULL;
+	if (!special || memchr(name, '\'', len) == NULL)
+		return special ? '\'' : 0;
+	return memchr(name, '"', len) == NULL ? '"' : 0;
+}
+
+/**
+ * Complete the word before the cursor. Commands are completed at the start of
+ * a command, after a pipe, a list operator or an opening parenthesis, and
+ * file names everywhere else. The longest common prefix of the candidates is
+ * inserted, quoted when it holds spaces or characters the shell would read
+ * as syntax, and if that adds nothing they are listed.
+ * @param ed line being edited
+ */
+void complete_line(struct line_editor *ed)
+{
+	int start = 0;
+	char quote = 0;
+	for (int i = 0; i < ed->pos; ++i)
+	{
+		char ch = ed->buf[i];
+		if (quote)
+			quote = ch == quote ? 0 : quote;
+		else if (ch == '"' || ch == '\'')
+			quote = ch;
+		else if (strchr(" \t;&|()", ch))
+			start = i + 1;
+	}
+	int before = start;
+	while (before > 0 && (ed->buf[before - 1] == ' ' || ed->buf[before - 1] == '\t'))
+		before--;
+	char open = 0; // quote the word was started with
+	if (start < ed->pos && (ed->buf[start] == '"' || ed->buf[start] == '\''))
+		open = ed->buf[start++];
+	const char *word = ed->buf + start;
+	int len = ed->pos - start;
+
+	struct candidates c = {0};
+	bool commands = (before == 0 || strchr(";&|(", ed->buf[before - 1])) && !open && memchr(word, '/', len) == NULL;
+	if (commands)
+	{
+		command_cache_refresh();
+		char prefix[LINE_SIZE];
+		memcpy(prefix, word, len);
+		prefix[len] = 0;
+		struct trie_node *node = len ? trie_find(command_cache.trie, prefix) : NULL;
+		if (node && node->terminal)
+			candidates_add(&c, prefix, len);
+		if (node || len == 0)
+			trie_collect(node ? node->child : command_cache.trie, prefix, len, &c);
+	}
+	else
+		complete_file(word, len, &c);
+
+	if (c.count == 0)
+	{
+		write(STDOUT_FILENO, "\a", 1);
+		return;
+	}
+
+	// the file candidates only hold the last path component
+	int base = len;
+	if (!commands)
+		for (int i = 0; i < len; ++i)
+			if (word[i] == '/')
+				base = len - i - 1;
+
+	int common = strlen(c.items[0]);
+	for (int i = 1; i < c.count; ++i)
+	{
+		int k = 0;
+		while (k < common && c.items[i][k] == c.items[0][k])
+			k++;
+		common = k;
+	}
+
+	quote = !commands && !open && common > base ? completion_quote(c.items[0] + base, common - base) : 0;
+	if (quote)
+	{
+		// open a quote at the start of the word, the cursor stays at its end
+		int pos = ed->pos;
+		ed->pos = start;
+		line_insert(ed, &quote, 1);
+		ed->pos = pos + 1;
+		open = quote;
+	}
+	if (common > base)
+		line_insert(ed, c.items[0] + base, common - base);
+	if (c.count == 1 && c.items[0][common - 1] != '/')
+	{
+		if (open)
+			line_insert(ed, &open, 1);
+		line_insert(ed, " ", 1);
+	}
+	if (c.count > 1 && common <= base)
+		show_candidates(ed, &c);
+	else
+		refresh_line(ed);
+	candidates_free(&c);
+}
+
+enum editor_keys
+{
+	KEY_NONE = 1000,
+	KEY_UP,
+	KEY_DOWN,
+	KEY_LEFT,
+	KEY_RIGHT,
+	KEY_HOME,
+	KEY_END,
+	KEY_DELETE,
+	KEY_WORD_LEFT,
+	KEY_WORD_RIGHT,
+	KEY_PAGE_UP,
+	KEY_PAGE_DOWN,
+};
+
+/**
+ * Decode the escape sequence after an ESC byte. CSI (ESC [) and SS3 (ESC O)
+ * sequences are read up to their final byte so unknown keys are swallowed
+ * whole instead of being echoed.
+ * @return one of editor_keys
+ */
+int read_escape()
+{
+	int c = read_byte();
+	if (c == 'b')
+		return KEY_WORD_LEFT; // Alt+b
+	if (c == 'f')
+		return KEY_WORD_RIGHT; // Alt+f
+	if (c != '[' && c != 'O')
+		return KEY_NONE;
+
+	char params[16];
+	int n = 0, final;
+	while ((final = read_byte()) >= 0 && final >= 0x20 && final < 0x40)
+		if (n < sizeof(params) - 1)
+			params[n++] = final;
+	params[n] = 0;
+
+	int modifier = strstr(params, ";5") != NULL; // Ctrl held
+	switch (final)
+	{
+	case 'A':
+		return KEY_UP;
+	case 'B':
+		return KEY_DOWN;
+	case 'C':
+		return modifier ? KEY_WORD_RIGHT : KEY_RIGHT;
+	case 'D':
+		return modifier ? KEY_WORD_LEFT : KEY_LEFT;
+	case 'H':
+		return KEY_HOME;
+	case 'F':
+		return KEY_END;
+	case '~':
+		switch (atoi(params))
+		{
+		case 1:
+		case 7:
+			return KEY_HOME;
+		case 4:
+		case 8:
+			return KEY_END;
+		case 3:
+			return KEY_DELETE;
+		case 5:
+			return KEY_PAGE_UP;
+		case 6:
+			return KEY_PAGE_DOWN;
+		}
+	}
+	return KEY_NONE;
+}
+
+/**
+ * Read a command line from the user
+ * @param  line buffer of LINE_SIZE bytes to fill
+ * @return      SUCCESS or EXIT on Ctrl+D
+ */
+int prompt(char *line)
+{
+	static struct line_editor ed;
+
+	// tcgetattr gets the parameters of the current terminal
+	// STDIN_FILENO will tell tcgetattr that it should write the settings
+	// of stdin to oldt
+	static struct termios backup_termios, new_termios;
+	tcgetattr(STDIN_FILENO, &backup_termios);
+	new_termios = backup_termios;
+	// ICANON normally takes care that one line at a time will be processed
+	// that means it will return if it sees a "\n" or an EOF or an EOL
+	new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We draw the line ourselves.
+	// Those new settings will be set to STDIN
+	// TCSANOW tells tcsetattr to change attributes immediately.
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+
+	struct winsize ws;
+	ed.columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+	fflush(stdout); // output of the previous command must come before the prompt
+	uint64_t t = trace_clock();
+	ed.prompt_len = show_prompt(ed.prompt, sizeof(ed.prompt), true);
+	ed.prompt_width = utf8_width(ed.prompt, ed.prompt_len);
+	ed.len = ed.pos = 0;
+	ed.buf[0] = 0;
+	ed.history_index = history_count;
+	refresh_line(&ed);
+	trace_span("show_prompt", t, NULL);
+	t = trace_clock();
+
+	bool redraw = false; // set when the line changed other than by typing at its end
+	int drawn = 0;		 // bytes of the line on the screen
+
+	while (1)
+	{
+		if (!input_pending() && git_worker_fd() >= 0)
+		{
+			// wait for a key or for a late git status to redraw the prompt with
+			struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN}, {.fd = git_worker_fd(), .events = POLLIN}};
+			if (poll(fds, 2, -1) > 0 && (fds[1].revents & POLLIN))
+			{
+				char drain[64];
+				while (read(fds[1].fd, drain, sizeof(drain)) > 0)
+					;
+				ed.prompt_len = show_prompt(ed.prompt, sizeof(ed.prompt), false);
+				ed.prompt_width = utf8_width(ed.prompt, ed.prompt_len);
+				refresh_line(&ed);
+				continue;
+			}
+		}
+		int c = read_byte();
+		int old_len = ed.len, old_pos = ed.pos;
+
+		if (c < 0 || (c == 4 && ed.len == 0)) // Ctrl+D on an empty line
+		{
+			tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+			return EXIT;
+		}
+		if (c == '\n' || c == '\r') // enter key
+		{
+			if (ed.len == 0)
+			{
+				write(STDOUT_FILENO, "\n", 1);
+				refresh_line(&ed);
+				drawn = 0;
+				continue;
+			}
+			ed.pos = ed.len;
+			refresh_line(&ed);
+			write(STDOUT_FILENO, "\n", 1);
+			break;
+		}
+		if (c == 9) // handle tab
+		{
+			complete_line(&ed);
+			drawn = ed.len;
+			continue;
+		}
+
+		if (c == 27)
+			c = read_escape();
+
+		switch (c)
+		{
+		case 127: // backspace
+		case 8:
+			if (ed.pos > 0)
+				line_delete(&ed, utf8_prev(ed.buf, ed.pos), ed.pos);
+			break;
+		case 4: // Ctrl+D
+		case KEY_DELETE:
+			if (ed.pos < ed.len)
+				line_delete(&ed, ed.pos, utf8_next(ed.buf, ed.len, ed.pos));
+			break;
+		case 1: // Ctrl+A
+		case KEY_HOME:
+			ed.pos = 0;
+			break;
+		case 5: // Ctrl+E
+		case KEY_END:
+			ed.pos = ed.len;
+			break;
+		case 2: // Ctrl+B
+		case KEY_LEFT:
+			if (ed.pos > 0)
+				ed.pos = utf8_prev(ed.buf, ed.pos);
+			break;
+		case 6: // Ctrl+F
+		case KEY_RIGHT:
+			if (ed.pos < ed.len)
+				ed.pos = utf8_next(ed.buf, ed.len, ed.pos);
+			break;
+		case KEY_WORD_LEFT:
+			ed.pos = line_word_start(&ed);
+			break;
+		case KEY_WORD_RIGHT:
+			ed.pos = line_word_end(&ed);
+			break;
+		case 23: // Ctrl+W
+			line_delete(&ed, line_word_start(&ed), ed.pos);
+			break;
+		case 21: // Ctrl+U
+			line_delete(&ed, 0, ed.pos);
+			break;
+		case 11: // Ctrl+K
+			line_delete(&ed, ed.pos, ed.len);
+			break;
+		case 16: // Ctrl+P
+		case KEY_UP:
+			line_history(&ed, -1);
+			redraw = true;
+			break;
+		case 14: // Ctrl+N
+		case KEY_DOWN:
+			line_history(&ed, 1);
+			redraw = true;
+			break;
+		case 12: // Ctrl+L
+			write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+			redraw = true;
+			break;
+		default:
+			if (c < 32 || c >= KEY_NONE) // other control characters
+				break;
+			{
+				// insert a whole UTF-8 character at once
+				char s[4] = {c};
+				int n = utf8_length(c);
+				for (int i = 1; i < n; ++i)
+					s[i] = read_byte();
+				line_insert(&ed, s, n);
+			}
+		}
+
+		if (ed.len != old_len || ed.pos != old_pos)
+			if (old_pos != old_len || ed.pos != ed.len || ed.len < old_len)
+				redraw = true;
+		if (input_pending())
+			continue; // draw once after the rest of a paste
+
+		if (redraw || ed.prompt_width + utf8_width(ed.buf, ed.len) >= ed.columns)
+			refresh_line(&ed);
+		else if (ed.len > drawn)
+			write(STDOUT_FILENO, ed.buf + drawn, ed.len - drawn); // typing at the end
+		redraw = false;
+		drawn = ed.len;
+	}
+
+	trace_span("read_line", t, NULL);
+	add_to_history(ed.buf);
+	memcpy(line, ed.buf, ed.len + 1);
+
+	// restore the old settings
+	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+	return SUCCESS;
+}
+
+#define PICKER_HEIGHT 15 // rows of candidates shown at most
+
+// State of pick()
+struct picker
+{
+	char **items;
+	int count;
+	int *matches; // indices of the items matching the query, best first
+	int *scores;  // score of every item for the current query
+	int match_count;
+	char query[256];
+	int query_len;
+	int cursor; // position in matches
+	int top;	// first match shown
+	int height; // rows of candidates
+	int columns;
+	bool *selected;
+	int selected_count;
+};
+
+/**
+ * Score an item against a fuzzy query: the characters of the query must
+ * appear in the item in order, ignoring case. The shortest window ending at
+ * the first full match is scored, so "foo" finds the basename of
+ * "f_o_o/foo". Characters at the start of a word or path component and runs
+ * of consecutive characters score higher, gaps cost.
+ * @return score, or INT_MIN when the item does not match
+ */
+int fuzzy_score(const char *item, const char *query)
+{
+	int qlen = strlen(query);
+	if (qlen == 0)
+		return 0;
+	int end = 0, q = 0;
+	for (; item[end] && q < qlen; ++end)
+		if (tolower((unsigned char)item[end]) == tolower((unsigned char)query[q]))
+			q++;
+	if (q < qlen)
+		return INT_MIN;
+	int start = end;
+	for (q = qlen - 1; q >= 0; --start)
+		if (tolower((unsigned char)item[start - 1]) == tolower((unsigned char)query[q]))
+			q--;
+
+	int score = 0, run = 0;
+	q = 0;
+	for (int i = start; i < end && q < qlen; ++i)
+	{
+		if (tolower((unsigned char)item[i]) != tolower((unsigned char)query[q]))
+		{
+			score -= 1;
+			run = 0;
+			continue;
+		}
+		score += 16;
+		if (i == 0 || strchr("/-_. ", item[i - 1]))
+			score += 8;
+		if (run > 0)
+			score += run < 4 ? 4 * run : 16;
+		run++;
+		q++;
+	}
+	return score;
+}
+
+struct picker *picker_sorting;
+
+int compare_picker_matches(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+	struct picker *p = picker_sorting;
+	if (p->scores[x] != p->scores[y])
+		return p->scores[x] > p->scores[y] ? -1 : 1;
+	size_t lx = strlen(p->items[x]), ly = strlen(p->items[y]);
+	if (lx != ly)
+		return lx < ly ? -1 : 1;
+	return x - y;
+}
+
+/**
+ * Update the matches for a new query. When the query only grew, only the
+ * previous matches can still match, so only they are scored again.
+ * @param p     picker
+ * @param grown the query is the previous one with characters appended
+ */
+void picker_filter(struct picker *p, bool grown)
+{
+	int n = 0;
+	if (grown)
+	{
+		for (int i = 0; i < p->match_count; ++i)
+			if ((p->scores[p->matches[i]] = fuzzy_score(p->items[p->matches[i]], p->query)) != INT_MIN)
+				p->matches[n++] = p->matches[i];
+	}
+	else
+	{
+		for (int i = 0; i < p->count; ++i)
+			if ((p->scores[i] = fuzzy_score(p->items[i], p->query)) != INT_MIN)
+				p->matches[n++] = i;
+	}
+	p->match_count = n;
+	if (p->query_len > 0)
+	{
+		picker_sorting = p;
+		qsort(p->matches, n, sizeof(int), compare_picker_matches);
+	}
+	p->cursor = p->top = 0;
+}
+
+// Bytes of the UTF-8 text s that fit in width columns
+int utf8_fit(const char *s, int width)
+{
+	int i = 0, len = strlen(s);
+	while (i < len)
+	{
+		int next = utf8_next(s, len, i);
+		int w = utf8_width(s + i, next - i);
+		if (w > width)
+			break;
+		width -= w;
+		i = next;
+	}
+	return i;
+}
+
+// Draw the query line and the visible window of matches with a single write
+void picker_render(struct picker *p, const char *title)
+{
+	size_t size = (p->height + 1) * (p->columns * 4 + 32) + 64, len = 0;
+	char *out = malloc(size);
+	len += snprintf(out + len, size - len, "\r\x1b[J");
+	char counter[32];
+	int counter_len = snprintf(counter, sizeof(counter), "  %d/%d", p->match_count, p->count);
+	if (p->selected_count > 0)
+		counter_len += snprintf(counter + counter_len, sizeof(counter) - counter_len, " (%d)", p->selected_count);
+	int fit = utf8_fit(title, p->columns / 2);
+	len += snprintf(out + len, size - len, "%.*s> ", fit, title);
+	int query_width = p->columns - utf8_width(title, fit) - 2 - counter_len - 1;
+	int shown = utf8_fit(p->query, query_width > 0 ? query_width : 0);
+	// when the query is too long to fit, show its end
+	const char *query = p->query + (p->query_len - shown);
+	len += snprintf(out + len, size - len, "%s\x1b[2m%s\x1b[0m", query, counter);
+
+	for (int row = 0; row < p->height && p->top + row < p->match_count; ++row)
+	{
+		int i = p->matches[p->top + row];
+		bool current = p->top + row == p->cursor;
+		fit = utf8_fit(p->items[i], p->columns - 5);
+		len += snprintf(out + len, size - len, "\r\n%s%s %.*s\x1b[0m", current ? "\x1b[1m>" : " ",
+						p->selected[i] ? "*" : " ", fit, p->items[i]);
+	}
+	int rows = p->match_count - p->top < p->height ? p->match_count - p->top : p->height;
+	if (rows > 0)
+		len += snprintf(out + len, size - len, "\x1b[%dA", rows);
+	len += snprintf(out + len, size - len, "\r\x1b[%dC",
+					utf8_width(title, utf8_fit(title, p->columns / 2)) + 2 + utf8_width(query, strlen(query)));
+	write(STDOUT_FILENO, out, len);
+	free(out);
+}
+
+// Move the cursor by delta matches and scroll the window to keep it visible
+void picker_move(struct picker *p, int delta)
+{
+	p->cursor += delta;
+	if (p->cursor >= p->match_count)
+		p->cursor = p->match_count - 1;
+	if (p->cursor < 0)
+		p->cursor = 0;
+	if (p->cursor < p->top)
+		p->top = p->cursor;
+	if (p->cursor >= p->top + p->height)
+		p->top = p->cursor - p->height + 1;
+}
+
+/**
+ * Ask for entries of a numbered list when the input is not a terminal
+ * @return number of entries selected
+ */
+int pick_numbered(const char *title, char **items, int count, bool multi, bool *selected)
+{
+	for (int i = 0; i < count; ++i)
+		printf("%d. %s\n", i + 1, items[i]);
+	printf("%s (%s): ", title, multi ? "numbers separated by spaces" : "number");
+	fflush(stdout);
+
+	char line[LINE_SIZE];
+	int len = 0, c;
+	while ((c = read_byte()) >= 0 && c != '\n' && c != '\r')
+		if (len < sizeof(line) - 1)
+			line[len++] = c;
+	line[len] = 0;
+	if (!isatty(STDIN_FILENO))
+		printf("\n"); // the answer was not echoed
+
+	int picked = 0;
+	char *p = line, *end;
+	for (long n; (n = strtol(p, &end, 10)), end != p; p = end)
+	{
+		if (n < 1 || n > count || selected[n - 1])
+			continue;
+		selected[n - 1] = true;
+		picked++;
+		if (!multi)
+			break;
+	}
+	return picked;
+}
+
+/**
+ * Let the user pick entries of a list. Typing narrows the list with a fuzzy
+ * match, the arrows, Ctrl+P/Ctrl+N and Page Up/Down move in it and Enter
+ * accepts. With multi, Tab marks several entries. Ctrl+C, Ctrl+G or Escape
+ * cancel. Only the rows that fit on the screen are drawn. When the input is
+ * not a terminal, a numbered list is printed instead.
+ * @param  title    shown before the query
+ * @param  items    entries to choose from
+ * @param  count    number of items
+ * @param  multi    allow selecting more than one entry
+ * @param  selected array of count flags, set for the entries picked
+ * @return          number of entries picked, 0 when cancelled
+ */
+int pick(const char *title, char **items, int count, bool multi, bool *selected)
+{
+	memset(selected, 0, sizeof(bool) * count);
+	if (count == 0)
+		return 0;
+	if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
+		return pick_numbered(title, items, count, multi, selected);
+
+	struct termios backup_termios, new_termios;
+	tcgetattr(STDIN_FILENO, &backup_termios);
+	new_termios = backup_termios;
+	new_termios.c_lflag &= ~(ICANON | ECHO | ISIG); // Ctrl+C cancels the pick, not the shell
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+
+	struct picker p = {.items = items, .count = count, .selected = selected};
+	struct winsize ws;
+	bool has_size = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0;
+	p.columns = has_size && ws.ws_col > 0 ? ws.ws_col : 80;
+	p.height = has_size && ws.ws_row > 2 ? ws.ws_row - 2 : PICKER_HEIGHT;
+	if (p.height > PICKER_HEIGHT)
+		p.height = PICKER_HEIGHT;
+	if (p.height > count)
+		p.height = count;
+	p.matches = malloc(sizeof(int) * count);
+	p.scores = malloc(sizeof(int) * count);
+	picker_filter(&p, false);
+
+	fflush(stdout);
+	// make room below the cursor so that the window never scrolls the screen
+	char room[PICKER_HEIGHT + 16];
+	memset(room, '\n', p.height);
+	write(STDOUT_FILENO, room, p.height + snprintf(room + p.height, sizeof(room) - p.height, "\x1b[%dA", p.height));
+
+	bool accepted = false;
+	while (1)
+	{
+		if (!input_pending())
+			picker_render(&p, title);
+		int c = read_byte();
+		if (c == 27)
+		{
+			struct pollfd fd = {.fd = STDIN_FILENO, .events = POLLIN};
+			if (!input_pending() && poll(&fd, 1, 50) <= 0)
+				break; // Escape alone
+			c = read_escape();
+		}
+		if (c < 0 || c == 3 || c == 4 || c == 7) // Ctrl+C, Ctrl+D, Ctrl+G
+			break;
+		if (c == '\n' || c == '\r')
+		{
+			if (p.selected_count == 0 && p.match_count > 0)
+			{
+				selected[p.matches[p.cursor]] = true;
+				p.selected_count = 1;
+			}
+			accepted = p.selected_count > 0;
+			break;
+		}
+
+		switch (c)
+		{
+		case 9: // Tab
+			if (multi && p.match_count > 0)
+			{
+				int i = p.matches[p.cursor];
+				selected[i] = !selected[i];
+				p.selected_count += selected[i] ? 1 : -1;
+				picker_move(&p, 1);
+			}
+			break;
+		case 16: // Ctrl+P
+		case KEY_UP:
+			picker_move(&p, -1);
+			break;
+		case 14: // Ctrl+N
+		case KEY_DOWN:
+			picker_move(&p, 1);
+			break;
+		case KEY_PAGE_UP:
+			picker_move(&p, -p.height);
+			break;
+		case KEY_PAGE_DOWN:
+			picker_move(&p, p.height);
+			break;
+		case 127: // backspace
+		case 8:
+			if (p.query_len > 0)
+			{
+				p.query[p.query_len = utf8_prev(p.query, p.query_len)] = 0;
+				picker_filter(&p, false);
+			}
+			break;
+		case 21: // Ctrl+U
+			p.query[p.query_len = 0] = 0;
+			picker_filter(&p, false);
+			break;
+		default:
+			if (c < 32 || c >= KEY_NONE)
+				break;
+			int n = utf8_length(c);
+			if (p.query_len + n < sizeof(p.query))
+			{
+				p.query[p.query_len] = c;
+				for (int i = 1; i < n; ++i)
+					p.query[p.query_len + i] = read_byte();
+				p.query[p.query_len += n] = 0;
+				picker_filter(&p, true);
+			}
+		}
+	}
+
+	write(STDOUT_FILENO, "\r\x1b[J", 4);
+	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+	free(p.matches);
+	free(p.scores);
+	if (!accepted)
+	{
+		memset(selected, 0, sizeof(bool) * count);
+		return 0;
+	}
+	return p.selected_count;
+}
+
+int process_command(struct command_t *command);
+void unload_module();
+int run_bench(double scale);
+int run_soak(long commands);
+int serve(const char *path);
+int serve_connect(const char *path, const char *line);
+
+enum list_type
+{
+	LIST_COMMAND,
+	LIST_SEQUENCE, // left ; right
+	LIST_AND,	   // left && right
+	LIST_OR,	   // left || right
+};
+
+// Node of the tree a command line is parsed into. Parentheses only group, so
+// they leave no node behind.
+struct list_node
+{
+	enum list_type type;
+	char *text; // LIST_COMMAND: parsed by parse_command when it runs, so $? and globs see the state of that moment
+	struct list_node *left, *right;
+	bool background; // an and-or list or a group followed by &, run in a forked shell
+};
+
+enum list_token
+{
+	TOKEN_END,
+	TOKEN_WORD,
+	TOKEN_SEMICOLON,
+	TOKEN_BACKGROUND,
+	TOKEN_AND,
+	TOKEN_OR,
+	TOKEN_OPEN,
+	TOKEN_CLOSE,
+};
+
+struct list_parser
+{
+	const char *p;
+	bool error;
+};
+
+enum list_token list_peek(struct list_parser *lp, int *length)
+{
+	while (*lp->p == ' ' || *lp->p == '\t')
+		lp->p++;
+	*length = 1;
+	switch (lp->p[0])
+	{
+	case 0:
+		*length = 0;
+		return TOKEN_END;
+	case ';':
+		return TOKEN_SEMICOLON;
+	case '(':
+		return TOKEN_OPEN;
+	case ')':
+		return TOKEN_CLOSE;
+	case '&':
+		if (lp->p[1] != '&')
+			return TOKEN_BACKGROUND;
+		*length = 2;
+		return TOKEN_AND;
+	case '|':
+		if (lp->p[1] != '|')
+			break; // a pipe belongs to the command
+		*length = 2;
+		return TOKEN_OR;
+	}
+	return TOKEN_WORD;
+}
+
+void list_syntax_error(struct list_parser *lp)
+{
+	if (lp->error)
+		return;
+	int length;
+	list_peek(lp, &length);
+	printf("-%s: syntax error near unexpected token `%.*s'\n", sysname, length ? length : 7, length ? lp->p : "newline");
+	lp->error = true;
+}
+
+struct list_node *list_new(enum list_type type, struct list_node *left, struct list_node *right)
+{
+	struct list_node *node = calloc(1, sizeof(struct list_node));
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	return node;
+}
+
+void free_list(struct list_node *node)
+{
+	if (!node)
+		return;
+	free_list(node->left);
+	free_list(node->right);
+	free(node->text);
+	free(node);
+}
+
+struct list_node *parse_list(struct list_parser *lp);
+
+// A command up to the next operator that is not quoted, or a group in parentheses
+struct list_node *parse_list_primary(struct list_parser *lp)
+{
+	int length;
+	enum list_token token = list_peek(lp, &length);
+	if (token == TOKEN_OPEN)
+	{
+		lp->p++;
+		struct list_node *node = parse_list(lp);
+		if (node && list_peek(lp, &length) == TOKEN_CLOSE)
+		{
+			lp->p++;
+			return node;
+		}
+		list_syntax_error(lp);
+		free_list(node);
+		return NULL;
+	}
+	if (token != TOKEN_WORD)
+	{
+		list_syntax_error(lp);
+		return NULL;
+	}
+
+	const char *start = lp->p;
+	char quote = 0;
+	for (; *lp->p; lp->p++)
+	{
+		if (quote)
+		{
+			if (*lp->p == quote)
+				quote = 0;
+		}
+		else if (*lp->p == '"' || *lp->p == '\'')
+			quote = *lp->p;
+		else if (strchr(";&()", *lp->p) || (lp->p[0] == '|' && lp->p[1] == '|'))
+			break;
+	}
+	int len = lp->p - start;
+	while (len > 0 && (start[len - 1] == ' ' || start[len - 1] == '\t'))
+		len--;
+	struct list_node *node = list_new(LIST_COMMAND, NULL, NULL);
+	node->text = strndup(start, len);
+	return node;
+}
+
+// Commands joined by && and ||, which bind tighter than ;
+struct list_node *parse_list_and_or(struct list_parser *lp)
+{
+	struct list_node *node = parse_list_primary(lp);
+	int length;
+	enum list_token token;
+	while (node && ((token = list_peek(lp, &length)) == TOKEN_AND || token == TOKEN_OR))
+	{
+		lp->p += length;
+		struct list_node *right = parse_list_primary(lp);
+		if (!right)
+		{
+			free_list(node);
+			return NULL;
+		}
+		node = list_new(token == TOKEN_AND ? LIST_AND : LIST_OR, node, right);
+	}
+	return node;
+}
+
+// Run the and-or list node in the background. A single command is left to
+// parse_command, anything larger runs as a whole in a forked shell.
+void list_background(struct list_node *node)
+{
+	if (node->type != LIST_COMMAND)
+	{
+		node->background = true;
+		return;
+	}
+	char *text = malloc(strlen(node->text) + 3);
+	sprintf(text, "%s &", node->text);
+	free(node->text);
+	node->text = text;
+}
+
+// A sequence of and/or lists separated by ; or &, up to the end or a )
+struct list_node *parse_list(struct list_parser *lp)
+{
+	struct list_node *node = parse_list_and_or(lp);
+	struct list_node *last = node; // the and-or list a & applies to
+	int length;
+	enum list_token token;
+	while (node && ((token = list_peek(lp, &length)) == TOKEN_SEMICOLON || token == TOKEN_BACKGROUND))
+	{
+		lp->p += length;
+		if (token == TOKEN_BACKGROUND)
+			list_background(last);
+		token = list_peek(lp, &length);
+		if (token == TOKEN_END || token == TOKEN_CLOSE)
+			break; // a trailing separator
+		struct list_node *right = parse_list_and_or(lp);
+		if (!right)
+		{
+			free_list(node);
+			return NULL;
+		}
+		last = right;
+		node = list_new(LIST_SEQUENCE, node, right);
+	}
+	return node;
+}
+
+/**
+ * Parse a command line into a tree of commands joined by ;, &, && and ||
+ * with ( ) for grouping
+ * @param  line the line typed at the prompt
+ * @return      the tree, NULL for an empty line or after a syntax error
+ */
+struct list_node *parse_command_line(const char *line)
+{
+	struct list_parser lp = {line, false};
+	int length;
+	if (list_peek(&lp, &length) == TOKEN_END)
+		return NULL;
+	struct list_node *node = parse_list(&lp);
+	if (node && list_peek(&lp, &length) != TOKEN_END)
+	{
+		list_syntax_error(&lp);
+		free_list(node);
+		node = NULL;
+	}
+	if (lp.error)
+		last_status = 2;
+	return node;
+}
+
+// Run the commands of a tree, && and || look at the status of their left side
+int run_list(struct list_node *node)
+{
+	int code;
+	if (list_interrupted)
+		return SUCCESS; // the rest of the line is dropped, like after Ctrl+C at a prompt
+	if (node->background)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			node->background = false;
+			run_list(node);
+			fflush(stdout);
+			_exit(last_status);
+		}
+		if (pid == -1)
+		{
+			printf("-%s: fork: %s\n", sysname, strerror(errno));
+			last_status = 126;
+		}
+		else
+			last_status = 0;
+		return SUCCESS;
+	}
+	switch (node->type)
+	{
+	case LIST_COMMAND:
+	{
+		char buf[LINE_SIZE];
+		struct command_t *command = calloc(1, sizeof(struct command_t));
+		snprintf(buf, sizeof(buf), "%s", node->text);
+		uint64_t t = trace_clock();
+		parse_command(buf, command);
+		glob_cache_clear(); // directory listings are only shared within a command
+		trace_span("parse_command", t, node->text);
+
+		// print_command(command); // DEBUG: uncomment for debugging
+
+		code = process_command(command);
+		free_command(command);
+		return code;
+	}
+	case LIST_SEQUENCE:
+		code = run_list(node->left);
+		return code == EXIT ? code : run_list(node->right);
+	case LIST_AND:
+		code = run_list(node->left);
+		return code == EXIT || last_status != 0 ? code : run_list(node->right);
+	case LIST_OR:
+		code = run_list(node->left);
+		return code == EXIT || last_status == 0 ? code : run_list(node->right);
+	}
+	return SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	setlocale(LC_CTYPE, ""); // for the widths of UTF-8 characters in the prompt
+	if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+		return run_bench(argc > 2 ? atof(argv[2]) : 1);
+	if (argc > 1 && strcmp(argv[1], "--soak") == 0)
+		return run_soak(argc > 2 ? atol(argv[2]) : 1000000);
+	if (argc > 2 && strcmp(argv[1], "--serve") == 0)
+		return serve(argv[2]);
+	if (argc > 4 && strcmp(argv[1], "--connect") == 0 && strcmp(argv[3], "-c") == 0)
+		return serve_connect(argv[2], argv[4]);
+
+	char line[LINE_SIZE];
+	while (1)
+	{
+		int code;
+		code = prompt(line);
+		if (code == EXIT)
+			break;
+
+		struct list_node *list = parse_command_line(line);
+		if (!list)
+			continue;
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		code = run_list(list);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		last_duration = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		generation++;
+		free_list(list);
+		if (code == EXIT)
+			break;
+	}
+
+	unload_module();
+	printf("\n");
+	return 0;
+}
+
+enum walk_action
+{
+	WALK_CONTINUE = 0,
+	WALK_SKIP, // do not descend into this directory
+	WALK_STOP,
+};
+
+// An entry found by walk_tree
+struct walk_entry
+{
+	int dirfd;		   // directory containing the entry
+	const char *name;  // name of the entry in dirfd
+	const char *path;  // path of the entry starting with the root of the walk
+	unsigned char type; // d_type of the entry, never DT_UNKNOWN
+	int depth;		   // 1 for the entries of the root
+};
+
+// Called for every entry, returns one of walk_action
+typedef int (*walk_fn)(struct walk_entry *entry, void *data);
+
+// What walk_tree leaves out
+struct walk_options
+{
+	int max_depth;		  // deepest level visited, 0 for no limit
+	bool same_filesystem; // do not descend into other mounts
+	bool follow;		  // descend into symbolic links to directories
+	bool ignore_files;	  // skip what the .gitignore and .ignore files in the tree exclude
+	char **prune;		  // fnmatch patterns of directory names never entered, NULL terminated
+};
+
+// A line of a .gitignore or .ignore file
+struct ignore_rule
+{
+	char *pattern;
+	bool negate;   // !pattern
+	bool dir_only; // pattern/
+	bool anchored; // contains a /, matched against the path below the directory of the file
+	bool deep;	   // contains **, * may then match a /
+};
+
+// The rules of the ignore files of one directory, cached across walks
+struct ignore_list
+{
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtimes[2]; // of .gitignore and .ignore, zero when missing
+	struct ignore_rule *rules;
+	int count;
+	struct ignore_list *next;
+};
+
+#define IGNORE_CACHE_BUCKETS 256
+#define IGNORE_CACHE_MAX 8192 // the cache is emptied before a walk once it grew beyond this
+
+struct ignore_list *ignore_cache[IGNORE_CACHE_BUCKETS];
+int ignore_cache_count = 0;
+
+const char *ignore_file_names[2] = {".gitignore", ".ignore"};
+
+void ignore_list_clear(struct ignore_list *l)
+{
+	for (int i = 0; i < l->count; ++i)
+		free(l->rules[i].pattern);
+	free(l->rules);
+	l->rules = NULL;
+	l->count = 0;
+}
+
+// Add the rules of the ignore file name in the directory dirfd
+void ignore_list_load(struct ignore_list *l, int dirfd, const char *name)
+{
+	int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	FILE *f = fd >= 0 ? fdopen(fd, "r") : NULL;
+	if (!f)
+	{
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), f))
+	{
+		int len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' '))
+			line[--len] = 0;
+		char *p = line;
+		if (len == 0 || p[0] == '#')
+			continue;
+
+		struct ignore_rule rule = {NULL, false, false, false, false};
+		if (p[0] == '!')
+		{
+			rule.negate = true;
+			p++;
+		}
+		else if (p[0] == '\\')
+			p++; // \# and \!
+		len = strlen(p);
+		if (len > 0 && p[len - 1] == '/')
+		{
+			rule.dir_only = true;
+			p[--len] = 0;
+		}
+		if (strncmp(p, "**/", 3) == 0 && !strchr(p + 3, '/'))
+			p += 3; // the same as a pattern without a slash
+		if (len > 3 && strcmp(p + strlen(p) - 3, "/**") == 0)
+			p[strlen(p) - 3] = 0; // everything below a directory, which is then never entered
+		if (p[0] == '/')
+		{
+			rule.anchored = true;
+			p++;
+		}
+		if (p[0] == 0)
+			continue;
+		rule.anchored |= strchr(p, '/') != NULL;
+		rule.deep = strstr(p, "**") != NULL;
+		rule.pattern = strdup(p);
+
+		if (l->count % 16 == 0)
+			l->rules = realloc(l->rules, sizeof(struct ignore_rule) * (l->count + 16));
+		l->rules[l->count++] = rule;
+	}
+	fclose(f);
+}
+
+// Empty the ignore cache once it grew too large. Only called between walks,
+// since the frames of a running walk point into the cached lists.
+void ignore_cache_trim(void)
+{
+	if (ignore_cache_count < IGNORE_CACHE_MAX)
+		return;
+	for (int i = 0; i < IGNORE_CACHE_BUCKETS; ++i)
+	{
+		while (ignore_cache[i])
+		{
+			struct ignore_list *next = ignore_cache[i]->next;
+			ignore_list_clear(ignore_cache[i]);
+			free(ignore_cache[i]);
+			ignore_cache[i] = next;
+		}
+	}
+	ignore_cache_count = 0;
+}
+
+/**
+ * Rules of the ignore files in a directory, parsed again only when one of
+ * the files changed
+ * @param  dirfd the directory
+ * @param  dir   fstat of dirfd
+ * @return       the rules, NULL if the directory has no ignore file
+ */
+struct ignore_list *ignore_list_get(int dirfd, const struct stat *dir)
+{
+	struct timespec mtimes[2] = {{0, 0}, {0, 0}};
+	bool any = false;
+	for (int i = 0; i < 2; ++i)
+	{
+		struct stat st;
+		if (fstatat(dirfd, ignore_file_names[i], &st, 0) == 0 && S_ISREG(st.st_mode))
+		{
+			mtimes[i] = st.st_mtim;
+			any = true;
+		}
+	}
+	if (!any)
+		return NULL;
+
+	struct ignore_list **bucket = &ignore_cache[dir->st_ino % IGNORE_CACHE_BUCKETS], *l;
+	for (l = *bucket; l; l = l->next)
+		if (l->dev == dir->st_dev && l->ino == dir->st_ino)
+			break;
+	if (l && memcmp(l->mtimes, mtimes, sizeof(mtimes)) == 0)
+		return l;
+
+	if (!l)
+	{
+		l = calloc(1, sizeof(struct ignore_list));
+		l->dev = dir->st_dev;
+		l->ino = dir->st_ino;
+		l->next = *bucket;
+		*bucket = l;
+		ignore_cache_count++;
+	}
+	ignore_list_clear(l);
+	memcpy(l->mtimes, mtimes, sizeof(mtimes));
+	for (int i = 0; i < 2; ++i)
+		ignore_list_load(l, dirfd, ignore_file_names[i]);
+	return l;
+}
+
+// Ignore files of a directory on the path of the walk
+struct ignore_frame
+{
+	struct ignore_list *list;
+	int base; // length of the path of the directory in walker.path
+};
+
+// Directory on the path of the walk, for loop detection
+struct walk_dir_id
+{
+	dev_t dev;
+	ino_t ino;
+};
+
+struct walker
+{
+	walk_fn visit;
+	void *data;
+	const struct walk_options *opts; // NULL to visit everything
+	dev_t root_dev;
+	struct walk_dir_id *ancestors;
+	struct ignore_frame *ignores;
+	int ancestor_count, ignore_count, capacity;
+	char path[PATH_MAX];
+};
+
+// Whether the last rule matching the entry at w->path, in the deepest ignore file first, excludes it
+bool walk_ignored(struct walker *w, const char *name, bool is_dir)
+{
+	for (int i = w->ignore_count - 1; i >= 0; --i)
+	{
+		struct ignore_list *l = w->ignores[i].list;
+		const char *relative = w->path + w->ignores[i].base;
+		if (*relative == '/')
+			relative++;
+		for (int r = l->count - 1; r >= 0; --r)
+		{
+			struct ignore_rule *rule = &l->rules[r];
+			if (rule->dir_only && !is_dir)
+				continue;
+			if (fnmatch(rule->pattern, rule->anchored ? relative : name, rule->deep ? 0 : FNM_PATHNAME) == 0)
+				return !rule->negate;
+		}
+	}
+	return false;
+}
+
+bool walk_pruned(struct walker *w, const char *name)
+{
+	for (char **p = w->opts->prune; p && *p; ++p)
+		if (fnmatch(*p, name, 0) == 0)
+			return true;
+	return false;
+}
+
+// Walk the directory open as fd whose path takes path_len bytes of w->path, closes fd
+int walk_dir(struct walker *w, int fd, int path_len, int depth)
+{
+	const struct walk_options *opts = w->opts;
+	struct stat dir_st;
+	bool pushed_ignore = false;
+	if (opts && (opts->follow || opts->same_filesystem || opts->ignore_files))
+	{
+		if (fstat(fd, &dir_st) == -1)
+		{
+			close(fd);
+			return WALK_CONTINUE;
+		}
+		if (opts->same_filesystem && dir_st.st_dev != w->root_dev)
+		{
+			close(fd);
+			return WALK_CONTINUE;
+		}
+		if (w->capacity <= w->ancestor_count || w->capacity <= w->ignore_count)
+		{
+			w->capacity = w->capacity ? w->capacity * 2 : 32;
+			w->ancestors = realloc(w->ancestors, sizeof(struct walk_dir_id) * w->capacity);
+			w->ignores = realloc(w->ignores, sizeof(struct ignore_frame) * w->capacity);
+		}
+		if (opts->follow)
+		{
+			for (int i = 0; i < w->ancestor_count; ++i)
+			{
+				if (w->ancestors[i].dev == dir_st.st_dev && w->ancestors[i].ino == dir_st.st_ino)
+				{
+					fprintf(stderr, "-%s: %s: file system loop detected\n", sysname, w->path);
+					close(fd);
+					return WALK_CONTINUE;
+				}
+			}
+		}
+		w->ancestors[w->ancestor_count++] = (struct walk_dir_id){dir_st.st_dev, dir_st.st_ino};
+		struct ignore_list *l = opts->ignore_files ? ignore_list_get(fd, &dir_st) : NULL;
+		if (l && l->count > 0)
+		{
+			w->ignores[w->ignore_count++] = (struct ignore_frame){l, path_len};
+			pushed_ignore = true;
+		}
+	}
+
+	int action = WALK_CONTINUE;
+	DIR *dir = fdopendir(fd);
+	if (!dir)
+		close(fd); // the frames pushed above are still popped below
+	struct dirent *ent;
+	while (dir && action != WALK_STOP && (ent = readdir(dir)) != NULL)
+	{
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		int name_len = strlen(ent->d_name);
+		int len = path_len;
+		if (len > 0 && w->path[len - 1] != '/')
+			w->path[len++] = '/';
+		if (len + name_len >= PATH_MAX)
+			continue;
+		memcpy(w->path + len, ent->d_name, name_len + 1);
+
+		// some file systems leave d_type empty, links are resolved when followed
+		unsigned char type = ent->d_type;
+		if (type == DT_UNKNOWN || (type == DT_LNK && opts && opts->follow))
+		{
+			struct stat st;
+			if (fstatat(fd, ent->d_name, &st, type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW) == 0)
+				type = IFTODT(st.st_mode);
+			else if (type == DT_UNKNOWN)
+				type = DT_REG;
+		}
+		if (opts && ((type == DT_DIR && walk_pruned(w, ent->d_name)) ||
+					 (w->ignore_count > 0 && walk_ignored(w, ent->d_name, type == DT_DIR))))
+		{
+			w->path[path_len] = 0;
+			continue;
+		}
+
+		struct walk_entry entry = {fd, ent->d_name, w->path, type, depth};
+		action = w->visit(&entry, w->data);
+		if (action == WALK_CONTINUE && type == DT_DIR && (!opts || !opts->max_depth || depth < opts->max_depth))
+		{
+			int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (opts && opts->follow ? 0 : O_NOFOLLOW);
+			int sub = openat(fd, ent->d_name, flags);
+			if (sub >= 0)
+				action = walk_dir(w, sub, len + name_len, depth + 1);
+		}
+		else if (action == WALK_SKIP)
+			action = WALK_CONTINUE;
+		w->path[path_len] = 0;
+	}
+	if (dir)
+		closedir(dir);
+
+	if (pushed_ignore)
+		w->ignore_count--;
+	if (opts && (opts->follow || opts->same_filesystem || opts->ignore_files))
+		w->ancestor_count--;
+	return action;
+}
+
+/**
+ * Walk the tree below root depth first with openat and fdopendir, so the
+ * working directory is never changed and no path is resolved twice.
+ * @param  root  directory to walk, "" for the working directory without a
+ *               prefix in the reported paths
+ * @param  opts  what to leave out, NULL to visit every entry
+ * @param  visit called for every entry
+ * @param  data  passed to visit
+ * @return       0, or -1 if root can not be opened
+ */
+int walk_tree_options(const char *root, const struct walk_options *opts, walk_fn visit, void *data)
+{
+	ignore_cache_trim();
+	struct walker *w = calloc(1, sizeof(struct walker));
+	w->visit = visit;
+	w->data = data;
+	w->opts = opts;
+	snprintf(w->path, sizeof(w->path), "%s", root);
+	int fd = open(root[0] ? root : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat st;
+	if (fd >= 0 && fstat(fd, &st) == 0)
+	{
+		w->root_dev = st.st_dev;
+		walk_dir(w, fd, strlen(w->path), 1);
+	}
+	else if (fd >= 0)
+		close(fd);
+	free(w->ancestors);
+	free(w->ignores);
+	free(w);
+	return fd < 0 ? -1 : 0;
+}
+
+int walk_tree(const char *root, walk_fn visit, void *data)
+{
+	return walk_tree_options(root, NULL, visit, data);
+}
+
+// Open a file with the default application
+void open_file(const char *path)
+{
+	char *argv[] = {"xdg-open", (char *)path, NULL};
+	pid_t pid;
+	if (posix_spawnp(&pid, "xdg-open", NULL, NULL, argv, environ) == 0)
+		waitpid(pid, NULL, 0);
+}
+
+int available_cpus();
+
+#define SEARCH_QUEUE_SIZE 1024
+#define SEARCH_MMAP_MIN (256 * 1024) // smaller files are read into a buffer
+#define SEARCH_BINARY_CHECK 8192	 // a NUL in this many first bytes marks a binary file
+
+#define OUT_CHUNK (256 * 1024) // output is written once this much is buffered
+
+// Output formats of filesearch
+enum filesearch_format
+{
+	FORMAT_LINES, // path, or path:line:text
+	FORMAT_NUL,	  // path\0, or path\0line:text\n
+	FORMAT_JSON,  // one object per line
+	FORMAT_COUNT, // only the number of matches
+};
+
+// Growable output buffer, written out in large chunks
+struct out_buf
+{
+	char *data;
+	size_t len, cap;
+};
+
+void out_append(struct out_buf *b, const char *s, size_t len)
+{
+	if (b->len + len > b->cap)
+	{
+		b->cap = (b->len + len) * 2;
+		b->data = realloc(b->data, b->cap);
+	}
+	memcpy(b->data + b->len, s, len);
+	b->len += len;
+}
+
+void out_json_string(struct out_buf *b, const char *s, size_t len)
+{
+	char escape[8];
+	out_append(b, "\"", 1);
+	size_t run = 0;
+	for (size_t i = 0; i < len; ++i)
+	{
+		unsigned char c = s[i];
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+		out_append(b, s + run, i - run);
+		if (c == '"' || c == '\\')
+			out_append(b, escape, snprintf(escape, sizeof(escape), "\\%c", c));
+		else
+			out_append(b, escape, snprintf(escape, sizeof(escape), "\\u%04x", c));
+		run = i + 1;
+	}
+	out_append(b, s + run, len - run);
+	out_append(b, "\"", 1);
+}
+
+// Write the buffer to stdout and empty it
+void out_write(struct out_buf *b)
+{
+	size_t done = 0;
+	while (done < b->len)
+	{
+		ssize_t n = write(STDOUT_FILENO, b->data + done, b->len - done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break; // the reader went away, drop the rest
+		done += n;
+	}
+	b->len = 0;
+}
+
+// Matches of one file, kept until the end for --sort
+struct file_result
+{
+	char *path;
+	char *data;
+	size_t len;
+};
+
+int compare_file_results(const void *a, const void *b)
+{
+	return strcmp(((struct file_result *)a)->path, ((struct file_result *)b)->path);
+}
+
+// Files found by the walk, waiting for a worker to scan them
+struct search_queue
+{
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+	char *paths[SEARCH_QUEUE_SIZE];
+	int head, count;
+	bool done; // the walk finished
+	const char *pattern;
+	size_t pattern_len;
+	int format;
+	bool sort;
+	pthread_mutex_t output_lock; // guards stdout and everything below
+	unsigned long matches;
+	struct file_result *results; // with sort
+	int result_count, result_capacity;
+};
+
+void search_queue_push(struct search_queue *q, char *path)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == SEARCH_QUEUE_SIZE)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	q->paths[(q->head + q->count++) % SEARCH_QUEUE_SIZE] = path;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+// Next file to scan, NULL when the walk is over and the queue is drained
+char *search_queue_pop(struct search_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->done)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	char *path = NULL;
+	if (q->count > 0)
+	{
+		path = q->paths[q->head];
+		q->head = (q->head + 1) % SEARCH_QUEUE_SIZE;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return path;
+}
+
+// Append every line of data containing the pattern to out in the format of q, returns the number of lines
+unsigned long search_buffer(struct search_queue *q, const char *path, const char *data, size_t size,
+							struct out_buf *out)
+{
+	unsigned long matches = 0;
+	if (memchr(data, 0, size < SEARCH_BINARY_CHECK ? size : SEARCH_BINARY_CHECK))
+		return 0; // binary
+	const char *end = data + size, *counted = data, *match;
+	unsigned long line = 1;
+	char number[32];
+	while ((match = memmem(counted, end - counted, q->pattern, q->pattern_len)) != NULL)
+	{
+		const char *start = match;
+		while (start > counted && start[-1] != '\n')
+			start--;
+		for (const char *p = counted; (p = memchr(p, '\n', start - p)) != NULL; ++p)
+			line++;
+		const char *stop = memchr(match, '\n', end - match);
+		if (!stop)
+			stop = end;
+
+		matches++;
+		switch (q->format)
+		{
+		case FORMAT_LINES:
+		case FORMAT_NUL:
+			out_append(out, path, strlen(path) + (q->format == FORMAT_NUL)); // the NUL replaces the first :
+			out_append(out, number, snprintf(number, sizeof(number), q->format == FORMAT_NUL ? "%lu:" : ":%lu:", line));
+			out_append(out, start, stop - start);
+			out_append(out, "\n", 1);
+			break;
+		case FORMAT_JSON:
+			out_append(out, "{\"path\":", 8);
+			out_json_string(out, path, strlen(path));
+			out_append(out, number, snprintf(number, sizeof(number), ",\"line\":%lu,\"text\":", line));
+			out_json_string(out, start, stop - start);
+			out_append(out, "}\n", 2);
+			break;
+		}
+
+		if (stop == end)
+			break;
+		counted = stop + 1;
+		line++;
+	}
+	return matches;
+}
+
+void *search_worker(void *arg)
+{
+	struct search_queue *q = arg;
+	struct out_buf out = {NULL, 0, 0};
+	char *buf = malloc(SEARCH_MMAP_MIN); // reused for every small file
+	char *path;
+	unsigned long matches = 0;
+	while ((path = search_queue_pop(q)) != NULL)
+	{
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		{
+			if (st.st_size < SEARCH_MMAP_MIN)
+			{
+				ssize_t n, len = 0;
+				while (len < st.st_size && (n = read(fd, buf + len, st.st_size - len)) > 0)
+					len += n;
+				matches += search_buffer(q, path, buf, len, &out);
+			}
+			else
+			{
+				void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (data != MAP_FAILED)
+				{
+					madvise(data, st.st_size, MADV_SEQUENTIAL);
+					matches += search_buffer(q, path, data, st.st_size, &out);
+					munmap(data, st.st_size);
+				}
+			}
+		}
+		if (fd >= 0)
+			close(fd);
+
+		// only whole files are written, so the lines of a file stay together
+		if (q->sort && out.len > 0)
+		{
+			pthread_mutex_lock(&q->output_lock);
+			if (q->result_count == q->result_capacity)
+			{
+				q->result_capacity = q->result_capacity ? q->result_capacity * 2 : 256;
+				q->results = realloc(q->results, sizeof(struct file_result) * q->result_capacity);
+			}
+			q->results[q->result_count++] = (struct file_result){path, out.data, out.len};
+			pthread_mutex_unlock(&q->output_lock);
+			memset(&out, 0, sizeof(out));
+			continue;
+		}
+		if (out.len >= OUT_CHUNK)
+		{
+			pthread_mutex_lock(&q->output_lock);
+			out_write(&out);
+			pthread_mutex_unlock(&q->output_lock);
+		}
+		free(path);
+	}
+
+	pthread_mutex_lock(&q->output_lock);
+	out_write(&out);
+	q->matches += matches;
+	pthread_mutex_unlock(&q->output_lock);
+	free(buf);
+	free(out.data);
+	return NULL;
+}
+
+// io_uring used to stat a batch of files with one system call, set up on first use
+struct
+{
+	bool tried, usable;
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+} statx_ring;
+
+#define STATX_BATCH 256
+
+bool statx_ring_setup()
+{
+	statx_ring.tried = true;
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, STATX_BATCH, &p);
+	if (fd < 0)
+		return false; // old kernel, or disabled by seccomp or sysctl
+
+	// ask once whether the kernel has IORING_OP_STATX instead of guessing from failed requests
+	struct io_uring_probe *probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+	bool has_statx = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+					 probe->last_op >= IORING_OP_STATX && (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	if (!has_statx)
+	{
+		close(fd);
+		return false;
+	}
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	char *cq = sq;
+	if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+	{
+		close(fd); // the mappings go away with the process
+		return false;
+	}
+
+	statx_ring.fd = fd;
+	statx_ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	statx_ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	statx_ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	statx_ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	statx_ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	statx_ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	statx_ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	statx_ring.sqes = sqes;
+	statx_ring.usable = true;
+	return true;
+}
+
+// statx of count paths through the ring, false if the ring failed and the paths must be stat'ed again
+bool statx_ring_run(char **paths, struct statx *st, int *results, int count, unsigned int mask)
+{
+	unsigned tail = *statx_ring.sq_tail;
+	for (int i = 0; i < count; ++i, ++tail)
+	{
+		unsigned index = tail & *statx_ring.sq_mask;
+		struct io_uring_sqe *sqe = &statx_ring.sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)paths[i];
+		sqe->len = mask;
+		sqe->off = (uintptr_t)&st[i];
+		sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+		sqe->user_data = i;
+		statx_ring.sq_array[index] = index;
+	}
+	__atomic_store_n(statx_ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+	int submitted = 0, done = 0;
+	bool failed = false;
+	while (done < (failed ? submitted : count))
+	{
+		// the kernel takes what it can of the entries not submitted yet, and only waits when it took them all,
+		// so asking for every completion can not block on entries still in the ring
+		int to_submit = failed ? 0 : count - submitted;
+		int ret = syscall(__NR_io_uring_enter, statx_ring.fd, to_submit, failed ? submitted - done : count - done,
+						  IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret > 0)
+			submitted += ret;
+		else if (ret < 0 && errno == EINTR)
+			continue;
+		else if (ret < 0 && (errno == EAGAIN || errno == EBUSY) && submitted > done)
+		{
+			// out of resources until completions are reaped, wait for one
+			syscall(__NR_io_uring_enter, statx_ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		}
+		else if (to_submit > 0)
+		{
+			// the rest can not be submitted: wait for what is in flight, it writes into st
+			failed = true;
+			if (submitted == done)
+				break;
+		}
+		else if (ret < 0)
+			break;
+		unsigned head = *statx_ring.cq_head;
+		unsigned cq_tail = __atomic_load_n(statx_ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != cq_tail; ++head, ++done)
+		{
+			struct io_uring_cqe *cqe = &statx_ring.cqes[head & *statx_ring.cq_mask];
+			results[cqe->user_data] = cqe->res;
+		}
+		__atomic_store_n(statx_ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	return !failed;
+}
+
+/**
+ * statx a batch of paths, through io_uring when the kernel allows it and
+ * one call at a time otherwise
+ * @param paths   paths relative to the working directory, links are not followed
+ * @param st      receives the results
+ * @param results 0 or a negative errno for every path
+ * @param count   at most STATX_BATCH
+ * @param mask    STATX_* fields needed
+ */
+void statx_batch(char **paths, struct statx *st, int *results, int count, unsigned int mask)
+{
+	if (!statx_ring.tried)
+		statx_ring_setup();
+	if (statx_ring.usable)
+	{
+		if (statx_ring_run(paths, st, results, count, mask))
+			return;
+		statx_ring.usable = false;
+	}
+	for (int i = 0; i < count; ++i)
+		results[i] = statx(AT_FDCWD, paths[i], AT_SYMLINK_NOFOLLOW, mask, &st[i]) == 0 ? 0 : -errno;
+}
+
+// Conditions on the metadata of the files filesearch reports
+struct filesearch_filters
+{
+	unsigned int mask; // STATX_* fields the filters need, 0 when no stat is needed
+	int type;		   // DT_* to match, -1 for the default
+	long long larger, smaller; // bytes, -1 when not set
+	time_t newer, older;	   // bounds of the modification time, 0 when not set
+	bool by_user;
+	uid_t uid;
+	bool by_perm;
+	mode_t perm; // bits that must all be set
+};
+
+struct filesearch_options
+{
+	const char *keyword; // NULL matches every name when searching contents
+	bool recursive;
+	bool open;
+	struct search_queue *contents; // set for -c
+	struct walk_options walk;
+	struct filesearch_filters filters;
+	char *batch[STATX_BATCH]; // matches waiting for their statx
+	int batch_count;
+	int format;
+	bool sort;
+	struct candidates sorted; // matches held back for --sort
+	unsigned long matches;
+	struct out_buf out;
+};
+
+// Format a matching path into the output buffer
+void filesearch_output(struct filesearch_options *opts, const char *path)
+{
+	opts->matches++;
+	switch (opts->format)
+	{
+	case FORMAT_LINES:
+	case FORMAT_NUL:
+		out_append(&opts->out, path, strlen(path) + (opts->format == FORMAT_NUL));
+		if (opts->format == FORMAT_LINES)
+			out_append(&opts->out, "\n", 1);
+		break;
+	case FORMAT_JSON:
+		out_append(&opts->out, "{\"path\":", 8);
+		out_json_string(&opts->out, path, strlen(path));
+		out_append(&opts->out, "}\n", 2);
+		break;
+	}
+	if (opts->out.len >= OUT_CHUNK)
+		out_write(&opts->out);
+}
+
+// Report a file that passed every check
+void filesearch_emit(struct filesearch_options *opts, const char *path)
+{
+	if (opts->contents)
+	{
+		search_queue_push(opts->contents, strdup(path));
+		return;
+	}
+	if (opts->open)
+		open_file(path);
+	if (opts->sort)
+		candidates_add(&opts->sorted, path, strlen(path));
+	else
+		filesearch_output(opts, path);
+}
+
+bool filesearch_filters_match(struct filesearch_filters *f, struct statx *st)
+{
+	if (f->larger >= 0 && (long long)st->stx_size <= f->larger)
+		return false;
+	if (f->smaller >= 0 && (long long)st->stx_size >= f->smaller)
+		return false;
+	if (f->newer && st->stx_mtime.tv_sec <= f->newer)
+		return false;
+	if (f->older && st->stx_mtime.tv_sec >= f->older)
+		return false;
+	if (f->by_user && st->stx_uid != f->uid)
+		return false;
+	if (f->by_perm && (st->stx_mode & f->perm) != f->perm)
+		return false;
+	return true;
+}
+
+// statx the waiting matches and report those that pass the filters, in order
+void filesearch_flush(struct filesearch_options *opts)
+{
+	struct statx st[STATX_BATCH];
+	int results[STATX_BATCH];
+	statx_batch(opts->batch, st, results, opts->batch_count, opts->filters.mask);
+	for (int i = 0; i < opts->batch_count; ++i)
+	{
+		if (results[i] == 0 && filesearch_filters_match(&opts->filters, &st[i]))
+			filesearch_emit(opts, opts->batch[i]);
+		free(opts->batch[i]);
+	}
+	opts->batch_count = 0;
+}
+
+int filesearch_visit(struct walk_entry *entry, void *data)
+{
+	struct filesearch_options *opts = data;
+	int next = opts->recursive ? WALK_CONTINUE : WALK_SKIP;
+	if (opts->keyword && strstr(entry->name, opts->keyword) == NULL)
+		return next;
+
+	// by default content searches skip directories and links, recursive name
+	// searches directories and the name search of the working directory nothing
+	if (opts->filters.type >= 0)
+	{
+		if (entry->type != opts->filters.type)
+			return next;
+	}
+	else if ((opts->contents && (entry->type == DT_DIR || entry->type == DT_LNK)) ||
+			 (opts->recursive && entry->type == DT_DIR))
+		return next;
+
+	if (opts->filters.mask == 0)
+		filesearch_emit(opts, entry->path);
+	else
+	{
+		opts->batch[opts->batch_count++] = strdup(entry->path);
+		if (opts->batch_count == STATX_BATCH)
+			filesearch_flush(opts);
+	}
+	return next;
+}
+
+// Walk the tree and let a thread per CPU scan the files it finds for pattern
+void filesearch_contents(struct filesearch_options *opts, const char *pattern)
+{
+	struct search_queue q;
+	memset(&q, 0, sizeof(q));
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_mutex_init(&q.output_lock, NULL);
+	pthread_cond_init(&q.not_empty, NULL);
+	pthread_cond_init(&q.not_full, NULL);
+	q.pattern = pattern;
+	q.pattern_len = strlen(pattern);
+	q.format = opts->format;
+	q.sort = opts->sort;
+	opts->contents = &q;
+
+	int count = available_cpus();
+	pthread_t *workers = malloc(sizeof(pthread_t) * count);
+	fflush(stdout);
+	for (int i = 0; i < count; ++i)
+		pthread_create(&workers[i], NULL, search_worker, &q);
+
+	walk_tree_options(opts->recursive ? "." : "", &opts->walk, filesearch_visit, opts);
+	filesearch_flush(opts);
+
+	pthread_mutex_lock(&q.lock);
+	q.done = true;
+	pthread_cond_broadcast(&q.not_empty);
+	pthread_mutex_unlock(&q.lock);
+	for (int i = 0; i < count; ++i)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	if (q.result_count > 0)
+		qsort(q.results, q.result_count, sizeof(struct file_result), compare_file_results);
+	for (int i = 0; i < q.result_count; ++i)
+	{
+		struct out_buf b = {q.results[i].data, q.results[i].len, q.results[i].len};
+		out_write(&b);
+		free(q.results[i].data);
+		free(q.results[i].path);
+	}
+	free(q.results);
+	opts->matches = q.matches;
+
+	pthread_mutex_destroy(&q.lock);
+	pthread_mutex_destroy(&q.output_lock);
+	pthread_cond_destroy(&q.not_empty);
+	pthread_cond_destroy(&q.not_full);
+}
+
+// Parse a size with an optional K, M, G or T suffix, -1 if invalid
+long long parse_size(const char *s)
+{
+	char *end;
+	double value = strtod(s, &end);
+	const char *units = "KMGT", *unit;
+	if (end == s || value < 0)
+		return -1;
+	if (*end == 0)
+		return value;
+	if (end[1] != 0 || (unit = strchr(units, toupper((unsigned char)*end))) == NULL)
+		return -1;
+	for (int i = 0; i <= unit - units; ++i)
+		value *= 1024;
+	return value;
+}
+
+// Parse an age with an optional s, m, h, d or w suffix into seconds, days without one, -1 if invalid
+long long parse_age(const char *s)
+{
+	char *end;
+	double value = strtod(s, &end);
+	if (end == s || value < 0 || (*end && end[1]))
+		return -1;
+	switch (*end)
+	{
+	case 's':
+		return value;
+	case 'm':
+		return value * 60;
+	case 'h':
+		return value * 3600;
+	case 0:
+	case 'd':
+		return value * 86400;
+	case 'w':
+		return value * 7 * 86400;
+	}
+	return -1;
+}
+
+/**
+ * Apply a metadata filter option of filesearch
+ * @param  f     filters to update, mask becomes -1 after an invalid value
+ * @param  name  the option, --larger for example
+ * @param  value its argument
+ * @return       false if name is not a filter
+ */
+bool filesearch_filter(struct filesearch_filters *f, const char *name, const char *value)
+{
+	long long n = 0;
+	bool valid = true;
+	if (strcmp(name, "--larger") == 0 || strcmp(name, "--smaller") == 0)
+	{
+		valid = (n = parse_size(value)) >= 0;
+		*(name[2] == 'l' ? &f->larger : &f->smaller) = n;
+		f->mask |= STATX_SIZE;
+	}
+	else if (strcmp(name, "--newer") == 0 || strcmp(name, "--older") == 0)
+	{
+		valid = (n = parse_age(value)) >= 0;
+		*(name[2] == 'n' ? &f->newer : &f->older) = time(NULL) - n;
+		f->mask |= STATX_MTIME;
+	}
+	else if (strcmp(name, "--type") == 0)
+	{
+		const char *types = "fdlpsbc", *t = value[0] && !value[1] ? strchr(types, value[0]) : NULL;
+		const int dtypes[] = {DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_BLK, DT_CHR};
+		valid = t != NULL;
+		if (valid)
+			f->type = dtypes[t - types]; // known from the directory entry, no stat needed
+	}
+	else if (strcmp(name, "--user") == 0)
+	{
+		struct passwd *pw = getpwnam(value);
+		char *end;
+		f->uid = pw ? pw->pw_uid : strtoul(value, &end, 10);
+		valid = pw || (*value && *end == 0);
+		f->by_user = true;
+		f->mask |= STATX_UID;
+	}
+	else if (strcmp(name, "--perm") == 0)
+	{
+		char *end;
+		f->perm = strtoul(value, &end, 8) & 07777;
+		valid = *value && *end == 0;
+		f->by_perm = true;
+		f->mask |= STATX_MODE;
+	}
+	else
+		return false;
+
+	if (!valid)
+	{
+		printf("-%s: filesearch: %s: invalid value for %s\n", sysname, value, name);
+		f->mask = -1;
+	}
+	return true;
+}
+
+// Directory names filesearch never enters, colon separated, unless SHELLFYRE_PRUNE is set
+#define FILESEARCH_PRUNE ".git:node_modules"
+
+// filesearch [-r] [-o] [-c PATTERN] [walk options] KEYWORD
+// Lists the files in the working directory whose name contains KEYWORD. With -r
+// the search descends into subdirectories, with -o the matches are opened.
+// With -c the lines containing PATTERN are printed as path:line:text instead,
+// KEYWORD then only narrows the files that are searched and may be omitted.
+// Recursive searches skip what .gitignore and .ignore files exclude and the
+// directories in SHELLFYRE_PRUNE, see the usage for the rest.
+int filesearch(struct command_t *command)
+{
+	struct filesearch_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.walk.ignore_files = true;
+	opts.filters.type = -1;
+	opts.filters.larger = opts.filters.smaller = -1;
+	const char *pattern = NULL;
+	bool prune = true;
+	char **extra_prune = malloc(sizeof(char *) * (command->arg_count + 1));
+	int extra_count = 0;
+	for (int i = 0; i < command->arg_count; ++i)
+	{
+		char *arg = command->args[i];
+		bool has_value = i + 1 < command->arg_count;
+		if (strcmp(arg, "-r") == 0)
+			opts.recursive = true;
+		else if (strcmp(arg, "-o") == 0)
+			opts.open = true;
+		else if (strcmp(arg, "-c") == 0 && has_value)
+			pattern = command->args[++i];
+		else if (strcmp(arg, "--no-ignore") == 0)
+			opts.walk.ignore_files = false;
+		else if (strcmp(arg, "--no-prune") == 0)
+			prune = false;
+		else if (strcmp(arg, "--prune") == 0 && has_value)
+			extra_prune[extra_count++] = command->args[++i];
+		else if (strcmp(arg, "-xdev") == 0 || strcmp(arg, "--one-file-system") == 0)
+			opts.walk.same_filesystem = true;
+		else if (strcmp(arg, "-L") == 0 || strcmp(arg, "--follow") == 0)
+			opts.walk.follow = true;
+		else if (strcmp(arg, "--max-depth") == 0 && has_value)
+			opts.walk.max_depth = atoi(command->args[++i]);
+		else if (strcmp(arg, "-0") == 0 || strcmp(arg, "--null") == 0)
+			opts.format = FORMAT_NUL;
+		else if (strcmp(arg, "--json") == 0)
+			opts.format = FORMAT_JSON;
+		else if (strcmp(arg, "--count") == 0)
+			opts.format = FORMAT_COUNT;
+		else if (strcmp(arg, "--sort") == 0)
+			opts.sort = true;
+		else if (strncmp(arg, "--", 2) == 0 && has_value && filesearch_filter(&opts.filters, arg, command->args[i + 1]))
+			i++;
+		else
+			opts.keyword = arg;
+	}
+	if (opts.filters.mask == (unsigned int)-1)
+	{
+		free(extra_prune);
+		return FAILURE; // an invalid filter was reported
+	}
+	if (!(pattern && pattern[0]) && !opts.keyword && !opts.filters.mask && opts.filters.type < 0)
+	{
+		printf("Usage: filesearch [-r] [-o] [-c PATTERN] [--no-ignore] [--no-prune] [--prune NAME]\n"
+			   "                  [-xdev] [--follow] [--max-depth N] [--larger SIZE] [--smaller SIZE]\n"
+			   "                  [--newer AGE] [--older AGE] [--type f|d|l|p|s|b|c] [--user USER]\n"
+			   "                  [--perm MODE] [-0|--json|--count] [--sort] KEYWORD\n"
+			   "SIZE is in bytes or ends with K, M, G or T. AGE is in days or ends with s, m, h, d or w.\n");
+		free(extra_prune);
+		return FAILURE;
+	}
+
+	// the prune list, from the environment or the default, then --prune
+	const char *env = getenv("SHELLFYRE_PRUNE");
+	char *names = strdup(prune ? (env ? env : FILESEARCH_PRUNE) : "");
+	int count = extra_count + 1;
+	for (char *p = names; *p; ++p)
+		count += *p == ':';
+	opts.walk.prune = malloc(sizeof(char *) * (count + 1));
+	count = 0;
+	char *save, *name;
+	for (name = strtok_r(names, ":", &save); name; name = strtok_r(NULL, ":", &save))
+		opts.walk.prune[count++] = name;
+	for (int i = 0; i < extra_count; ++i)
+		opts.walk.prune[count++] = extra_prune[i];
+	opts.walk.prune[count] = NULL;
+
+	fflush(stdout); // the matches are written with write()
+	if (pattern && pattern[0])
+		filesearch_contents(&opts, pattern);
+	else
+	{
+		walk_tree_options(opts.recursive ? "." : "", &opts.walk, filesearch_visit, &opts);
+		filesearch_flush(&opts);
+		if (opts.sorted.count > 0)
+			qsort(opts.sorted.items, opts.sorted.count, sizeof(char *), compare_strings);
+		for (int i = 0; i < opts.sorted.count; ++i)
+			filesearch_output(&opts, opts.sorted.items[i]);
+		candidates_free(&opts.sorted);
+	}
+	if (opts.format == FORMAT_COUNT)
+	{
+		char count[32];
+		out_append(&opts.out, count, snprintf(count, sizeof(count), "%lu\n", opts.matches));
+	}
+	out_write(&opts.out);
+	free(opts.out.data);
+
+	free(opts.walk.prune);
+	free(names);
+	free(extra_prune);
+	return SUCCESS;
+}
+
+const char *glob_class_end(const char *p);
+
+/**
+ * Match a single path component against a glob pattern with *, ? and
+ * [...] (ranges, ! or ^ to negate). A leading dot must be matched
+ * explicitly.
+ * @return true if name matches
+ */
+bool glob_match(const char *pattern, const char *name)
+{
+	if (name[0] == '.' && pattern[0] != '.')
+		return false;
+
+	const char *star = NULL, *resume = NULL;
+	while (*name)
+	{
+		if (*pattern == '*')
+		{
+			star = ++pattern;
+			resume = name;
+			continue;
+		}
+		const char *end = *pattern == '[' ? glob_class_end(pattern) : NULL;
+		if (end) // an unclosed [ falls through and matches itself
+		{
+			const char *p = pattern + 1;
+			bool negate = *p == '!' || *p == '^', matched = false;
+			if (negate)
+				p++;
+			do
+			{
+				if (p[1] == '-' && p + 2 < end)
+				{
+					matched |= (unsigned char)*name >= (unsigned char)p[0] && (unsigned char)*name <= (unsigned char)p[2];
+					p += 3;
+				}
+				else
+					matched |= *p++ == *name;
+			} while (p < end);
+			if (matched != negate)
+			{
+				pattern = end + 1;
+				name++;
+				continue;
+			}
+		}
+		else if (*pattern && (*pattern == '?' || *pattern == *name))
+		{
+			pattern++;
+			name++;
+			continue;
+		}
+		if (!star)
+			return false;
+		// backtrack: let the last * take one more character
+		pattern = star;
+		name = ++resume;
+	}
+	while (*pattern == '*')
+		pattern++;
+	return *pattern == 0;
+}
+
+// The ] that closes the bracket expression starting at p, NULL when it is not
+// closed. A ] right after [ or [! is a member of the set.
+const char *glob_class_end(const char *p)
+{
+	p++;
+	if (*p == '!' || *p == '^')
+		p++;
+	if (*p == ']')
+		p++;
+	while (*p && *p != ']')
+		p++;
+	return *p ? p : NULL;
+}
+
+// Whether s has *, ? or a closed [...], a lone [ is an ordinary character
+bool has_glob_chars(const char *s)
+{
+	for (; *s; ++s)
+		if (*s == '*' || *s == '?' || (*s == '[' && glob_class_end(s)))
+			return true;
+	return false;
+}
+
+// Listing of a directory read during the expansion of the current command line
+struct glob_listing
+{
+	char *path;
+	char **names;
+	bool *is_dir;
+	int count;
+	struct glob_listing *next;
+};
+
+struct glob_listing *glob_cache = NULL;
+
+// Forget the listings, called after every command line
+void glob_cache_clear()
+{
+	while (glob_cache)
+	{
+		struct glob_listing *next = glob_cache->next;
+		for (int i = 0; i < glob_cache->count; ++i)
+			free(glob_cache->names[i]);
+		free(glob_cache->names);
+		free(glob_cache->is_dir);
+		free(glob_cache->path);
+		free(glob_cache);
+		glob_cache = next;
+	}
+}
+
+struct glob_listing *glob_list_dir(const char *path)
+{
+	struct glob_listing *l;
+	for (l = glob_cache; l; l = l->next)
+		if (strcmp(l->path, path) == 0)
+			return l;
+
+	l = calloc(1, sizeof(struct glob_listing));
+	l->path = strdup(path);
+	l->next = glob_cache;
+	glob_cache = l;
+
+	DIR *dir = opendir(path[0] ? path : ".");
+	if (!dir)
+		return l;
+	int capacity = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		if (l->count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			l->names = realloc(l->names, sizeof(char *) * capacity);
+			l->is_dir = realloc(l->is_dir, sizeof(bool) * capacity);
+		}
+		struct stat st;
+		l->is_dir[l->count] = ent->d_type == DT_DIR ||
+							  ((ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN) &&
+							   fstatat(dirfd(dir), ent->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode));
+		l->names[l->count++] = strdup(ent->d_name);
+	}
+	closedir(dir);
+	return l;
+}
+
+// Paths produced by the expansion of one pattern
+struct glob_result
+{
+	struct candidates paths;
+	size_t bytes; // what the paths add to argv
+	size_t limit;
+};
+
+void glob_add(struct glob_result *r, const char *base, const char *name)
+{
+	char path[PATH_MAX];
+	int n;
+	if (base[0] == 0)
+		n = snprintf(path, sizeof(path), "%s", name);
+	else
+		n = snprintf(path, sizeof(path), "%s%s%s", base, base[strlen(base) - 1] == '/' ? "" : "/", name);
+	if (n >= sizeof(path))
+		return;
+	r->bytes += n + 1 + sizeof(char *);
+	if (r->bytes <= r->limit)
+		candidates_add(&r->paths, path, n);
+}
+
+void glob_segments(const char *base, char **segments, int count, struct glob_result *r);
+
+struct globstar
+{
+	char **segments; // what follows the **
+	int count;
+	struct glob_result *result;
+};
+
+int globstar_visit(struct walk_entry *entry, void *data)
+{
+	struct globstar *g = data;
+	if (entry->name[0] == '.')
+		return WALK_SKIP; // ** does not enter hidden directories
+	if (g->count == 1)
+	{
+		// the common a/**/*.c: match the names during the walk
+		if (glob_match(g->segments[0], entry->name))
+			glob_add(g->result, "", entry->path);
+	}
+	else if (entry->type == DT_DIR)
+		glob_segments(entry->path, g->segments, g->count, g->result);
+	return g->result->bytes > g->result->limit ? WALK_STOP : WALK_CONTINUE;
+}
+
+// Expand the pattern components in segments below the directory base
+void glob_segments(const char *base, char **segments, int count, struct glob_result *r)
+{
+	if (r->bytes > r->limit)
+		return;
+	char *segment = segments[0];
+
+	if (strcmp(segment, "**") == 0)
+	{
+		if (count == 1)
+		{
+			glob_segments(base, (char *[]){"*"}, 1, r);
+			return;
+		}
+		// zero directories, then every directory below base
+		if (count > 2)
+			glob_segments(base, segments + 1, count - 1, r);
+		struct globstar g = {segments + 1, count - 1, r};
+		walk_tree(base, globstar_visit, &g);
+		return;
+	}
+
+	if (!has_glob_chars(segment))
+	{
+		char path[PATH_MAX];
+		struct stat st;
+		snprintf(path, sizeof(path), "%s%s%s", base, base[0] && base[strlen(base) - 1] != '/' ? "/" : "", segment);
+		if (count == 1 && lstat(path, &st) == 0)
+			glob_add(r, base, segment);
+		else if (count > 1 && stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+			glob_segments(path, segments + 1, count - 1, r);
+		return;
+	}
+
+	struct glob_listing *l = glob_list_dir(base);
+	for (int i = 0; i < l->count; ++i)
+	{
+		if (!glob_match(segment, l->names[i]))
+			continue;
+		if (count == 1)
+			glob_add(r, base, l->names[i]);
+		else if (l->is_dir[i])
+		{
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s%s%s", base, base[0] && base[strlen(base) - 1] != '/' ? "/" : "", l->names[i]);
+			glob_segments(path, segments + 1, count - 1, r);
+		}
+	}
+}
+
+/**
+ * Expand a glob pattern and append the sorted matches to args. Nothing is
+ * added if the pattern matches nothing.
+ * @param  pattern pattern with *, ?, [...] and ** components
+ * @param  args    argument array of the command, reallocated
+ * @param  count   number of arguments in args, updated
+ * @return         number of arguments added, -1 if argv would exceed the limit
+ */
+int glob_expand(const char *pattern, char ***args, int *count)
+{
+	struct glob_result r = {{0}, 0, 0};
+
+	// leave room for the environment and the arguments collected so far
+	r.limit = sysconf(_SC_ARG_MAX) / 2;
+	for (int i = 0; i < *count; ++i)
+		r.bytes += strlen((*args)[i]) + 1 + sizeof(char *);
+
+	char *copy = strdup(pattern);
+	char *segments[PATH_MAX / 2];
+	int n = 0;
+	char *save, *segment;
+	for (segment = strtok_r(copy, "/", &save); segment; segment = strtok_r(NULL, "/", &save))
+		segments[n++] = segment;
+	if (n > 0)
+		glob_segments(pattern[0] == '/' ? "/" : "", segments, n, &r);
+	free(copy);
+
+	if (r.bytes > r.limit)
+	{
+		candidates_free(&r.paths);
+		return -1;
+	}
+	if (r.paths.count > 1)
+		qsort(r.paths.items, r.paths.count, sizeof(char *), compare_strings);
+	*args = realloc(*args, sizeof(char *) * (*count + r.paths.count + 1));
+	for (int i = 0; i < r.paths.count; ++i)
+		(*args)[(*count)++] = r.paths.items[i];
+	free(r.paths.items);
+	return r.paths.count;
+}
+
+#define DIR_HISTORY_SIZE 1000 // directories kept in ~/.dir_history
+
+/**
+ * Read ~/.dir_history, oldest directory first
+ * @param  count receives the number of directories
+ * @return       array of strings to free
+ */
+char **read_directory_history(int *count)
+{
+	char *home = getenv("HOME");
+	char history_file[PATH_MAX];
+	snprintf(history_file, sizeof(history_file), "%s/.dir_history", home ? home : "");
+	*count = 0;
+	FILE *f = fopen(history_file, "r");
+	if (f == NULL)
+		return NULL;
+	char **lines = NULL;
+	int capacity = 0;
+	char line[PATH_MAX];
+	while (fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\n")] = 0;
+		if (line[0] == 0)
+			continue;
+		if (*count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			lines = realloc(lines, sizeof(char *) * capacity);
+		}
+		lines[(*count)++] = strdup(line);
+	}
+	fclose(f);
+	return lines;
+}
+
+void free_directory_history(char **lines, int count)
+{
+	for (int i = 0; i < count; ++i)
+		free(lines[i]);
+	free(lines);
+}
+
+int builtin_cd(struct command_t *command);
+
+// The command takes no arguments.
+// After calling cdh, the shell shows the most recently visited directories, newest first, in a
+// picker that narrows the list as the user types. After the user picks one, the shell switches
+// to that directory. If there are no previous directories to select from, the shell outputs a
+// warning.
+int cdh(struct command_t *command)
+{
+	int count;
+	char **lines = read_directory_history(&count);
+	if (count == 0)
+	{
+		printf("No history found\n");
+		free(lines);
+		return FAILURE;
+	}
+
+	// newest first, without repeats
+	char **items = malloc(sizeof(char *) * count);
+	int item_count = 0;
+	for (int i = count - 1; i >= 0; --i)
+	{
+		bool seen = false;
+		for (int j = 0; j < item_count && !seen; ++j)
+			seen = strcmp(items[j], lines[i]) == 0;
+		if (!seen)
+			items[item_count++] = lines[i];
+	}
+
+	bool *selected = malloc(sizeof(bool) * item_count);
+	int code = FAILURE; // nothing picked
+	if (pick("cdh", items, item_count, false, selected) > 0)
+	{
+		for (int i = 0; i < item_count; ++i)
+		{
+			if (!selected[i])
+				continue;
+			// Switch to the directory.
+			char *args[] = {items[i], NULL};
+			struct command_t cd = {.name = "cd", .arg_count = 1, .args = args};
+			code = builtin_cd(&cd);
+		}
+	}
+	free(selected);
+	free(items);
+	free_directory_history(lines, count);
+	return code;
+}
+
+void add_directory_to_history(char *path)
+{
+	// Read all the directories of ~/.dir_history
+	int count;
+	char **lines = read_directory_history(&count);
+	char *home = getenv("HOME");
+	char history_file[PATH_MAX];
+	snprintf(history_file, sizeof(history_file), "%s/.dir_history", home ? home : "");
+
+	// Remove the oldest paths if the history is full.
+	int first = count >= DIR_HISTORY_SIZE ? count - DIR_HISTORY_SIZE + 1 : 0;
+
+	// Write the history back with the new path at the end.
+	FILE *f = fopen(history_file, "w");
+	if (f)
+	{
+		for (int i = first; i < count; ++i)
+			if (strcmp(lines[i], path) != 0)
+				fprintf(f, "%s\n", lines[i]);
+		fprintf(f, "%s\n", path);
+		fclose(f);
+	}
+	free_directory_history(lines, count);
+}
+
+// In this part, you will implement a command called take which takes 1 argument: the name
+// of the directory you want to create and change into. The command will create a directory
+// and change into it. The command must create the intermediate directories along the way if
+// they do not exist. For example: if you call take A/B/C, the command should create the
+// directories that do not exist and change into the last one (i.e, A/B/C).
+// Note: the idea for the command was adapted from the take command from zsh.
+int take(struct command_t *command)
+{
+	if (command->arg_count == 0)
+	{
+		printf("Usage: take DIR\n");
+		return FAILURE;
+	}
+
+	// create the directory and the intermediate ones, like mkdir -p
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s", command->args[0]);
+	for (char *p = path + 1;; ++p)
+	{
+		if (*p != '/' && *p != 0)
+			continue;
+		char c = *p;
+		*p = 0;
+		if (mkdir(path, 0777) == -1 && errno != EEXIST)
+		{
+			printf("-%s: take: %s: %s\n", sysname, path, strerror(errno));
+			return FAILURE;
+		}
+		*p = c;
+		if (c == 0)
+			break;
+	}
+
+	char *args[] = {command->args[0], NULL};
+	struct command_t cd = {.name = "cd", .arg_count = 1, .args = args};
+	return builtin_cd(&cd);
+}
+
+// make a get request and save the response to a string
+int currency(struct command_t *command)
+{
+	if (command->arg_count == 0 || strlen(command->args[0]) > 64)
+	{
+		printf("Usage: currency FROM_TO\n");
+		return FAILURE;
+	}
+	// popen("curl -s https://api.exchangeratesapi.io/latest?base=USD", "r");
+	char *response = malloc(sizeof(char) * 1024);
+	char *url = malloc(sizeof(char) * 1024);
+	strcpy(url, "curl -s -S \"https://free.currconv.com/api/v7/convert?q=");
+	strcat(url, command->args[0]);
+	strcat(url, "&compact=ultra&apiKey=d527543660bed7ba1595\"");
+	FILE *f = popen(url, "r");
+	bool ok = f && fgets(response, 1024, f);
+	if (f)
+		pclose(f);
+	free(url);
+	char *tkn = ok ? strtok(response, ":") : NULL;
+	if (tkn)
+		tkn = strtok(NULL, ":");
+	if (!tkn)
+	{
+		printf("-%s: currency: no exchange rate for %s\n", sysname, command->args[0]);
+		free(response);
+		return FAILURE;
+	}
+	char *printed = malloc(sizeof(char) * 1024);
+	strcpy(printed, "The current exchange rate for ");
+	strcat(printed, command->args[0]);
+	strcat(printed, " is ");
+	for (int i = 0; i < strlen(tkn); ++i)
+	{
+		if (tkn[i] == '}')
+		{
+			tkn[i] = '\0';
+			break;
+		}
+	}
+	strcat(printed, tkn);
+	printf("%s\n", printed);
+	free(printed);
+	free(response);
+	return SUCCESS;
+}
+
+// The trash is a content addressed store in ~/.trash:
+//   blobs/<sha256>        one copy of every distinct content
+//   files/<id>            the trashed file, a hard link to its blob
+//   info/<id>.trashinfo   original path, deletion date and blob of the entry
+// so trashing the same content twice costs no space. Directories and other
+// files that are not regular are kept in files/ as they are, without a blob.
+
+struct sha256
+{
+	uint32_t state[8];
+	uint64_t length; // bytes hashed
+	unsigned char block[64];
+	size_t used;
+};
+
+const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(struct sha256 *h)
+{
+	const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+							  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+	memcpy(h->state, init, sizeof(init));
+	h->length = 0;
+	h->used = 0;
+}
+
+void sha256_block(struct sha256 *h, const unsigned char *p)
+{
+	uint32_t w[64], s[8];
+	for (int i = 0; i < 16; ++i)
+		w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	for (int i = 16; i < 64; ++i)
+	{
+		uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	memcpy(s, h->state, sizeof(s));
+	for (int i = 0; i < 64; ++i)
+	{
+		uint32_t t1 = s[7] + (ROTR(s[4], 6) ^ ROTR(s[4], 11) ^ ROTR(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) +
+					  sha256_k[i] + w[i];
+		uint32_t t2 = (ROTR(s[0], 2) ^ ROTR(s[0], 13) ^ ROTR(s[0], 22)) + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, sizeof(uint32_t) * 7);
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (int i = 0; i < 8; ++i)
+		h->state[i] += s[i];
+}
+
+void sha256_update(struct sha256 *h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	h->length += len;
+	if (h->used > 0)
+	{
+		size_t n = 64 - h->used < len ? 64 - h->used : len;
+		memcpy(h->block + h->used, p, n);
+		h->used += n;
+		p += n;
+		len -= n;
+		if (h->used < 64)
+			return;
+		sha256_block(h, h->block);
+		h->used = 0;
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		sha256_block(h, p);
+	memcpy(h->block, p, len);
+	h->used = len;
+}
+
+// Finish the hash and write it as 64 hex digits and a NUL to hex
+void sha256_hex(struct sha256 *h, char *hex)
+{
+	uint64_t bits = h->length * 8;
+	unsigned char pad[72] = {0x80};
+	size_t n = (h->used < 56 ? 56 : 120) - h->used;
+	for (int i = 0; i < 8; ++i)
+		pad[n + i] = bits >> (56 - i * 8);
+	sha256_update(h, pad, n + 8);
+	for (int i = 0; i < 8; ++i)
+		sprintf(hex + i * 8, "%08x", h->state[i]);
+}
+
+// Path of name in the subdirectory sub of ~/.trash, sub and name may be empty
+// Returns false when the path does not fit in buf
+bool trash_path(char *buf, size_t size, const char *sub, const char *name)
+{
+	const char *home = getenv("HOME");
+	int len = snprintf(buf, size, "%s/.trash%s%s%s%s", home ? home : "", sub[0] ? "/" : "", sub, name[0] ? "/" : "", name);
+	return len >= 0 && (size_t)len < size;
+}
+
+/**
+ * Copy the contents of one file to another, cloning the extents when the
+ * file system allows it
+ * @param  in   source, read from the current offset
+ * @param  out  destination, or -1 to only hash
+ * @param  hash if not NULL, the contents are hashed on the way, which rules out cloning
+ * @return      0, or -1 with errno set
+ */
+int copy_contents(int in, int out, struct sha256 *hash)
+{
+	if (!hash && ioctl(out, FICLONE, in) == 0)
+		return 0;
+	char *buf = malloc(1 << 20);
+	ssize_t n;
+	while ((n = read(in, buf, 1 << 20)) > 0)
+	{
+		if (hash)
+			sha256_update(hash, buf, n);
+		for (ssize_t done = 0, w; out >= 0 && done < n; done += w)
+		{
+			if ((w = write(out, buf + done, n - done)) < 0)
+			{
+				free(buf);
+				return -1;
+			}
+		}
+	}
+	free(buf);
+	return n < 0 ? -1 : 0;
+}
+
+/**
+ * Copy a file, a symbolic link or a whole directory tree to a path that does
+ * not exist yet, keeping modes and times
+ * @return 0, or -1 with errno set, in which case a part of the copy may be left
+ */
+int copy_tree(const char *source, const char *dest)
+{
+	struct stat st;
+	if (lstat(source, &st) == -1)
+		return -1;
+	int result = 0;
+	if (S_ISDIR(st.st_mode))
+	{
+		DIR *dir = opendir(source);
+		if (!dir || mkdir(dest, 0700) == -1) // writable until its entries are copied
+		{
+			if (dir)
+				closedir(dir);
+			return -1;
+		}
+		struct dirent *ent;
+		while (result == 0 && (ent = readdir(dir)) != NULL)
+		{
+			if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+				continue;
+			char *from = malloc(strlen(source) + strlen(ent->d_name) + 2);
+			char *to = malloc(strlen(dest) + strlen(ent->d_name) + 2);
+			sprintf(from, "%s/%s", source, ent->d_name);
+			sprintf(to, "%s/%s", dest, ent->d_name);
+			result = copy_tree(from, to);
+			free(from);
+			free(to);
+		}
+		closedir(dir);
+		if (result == 0)
+			result = chmod(dest, st.st_mode & 07777);
+	}
+	else if (S_ISREG(st.st_mode))
+	{
+		int in = open(source, O_RDONLY | O_CLOEXEC);
+		int out = in < 0 ? -1 : open(dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+		result = out < 0 ? -1 : copy_contents(in, out, NULL);
+		if (in >= 0)
+			close(in);
+		if (out >= 0)
+			close(out);
+	}
+	else if (S_ISLNK(st.st_mode))
+	{
+		char target[PATH_MAX];
+		ssize_t len = readlink(source, target, sizeof(target) - 1);
+		if (len >= 0)
+			target[len] = 0;
+		result = len < 0 ? -1 : symlink(target, dest);
+	}
+	else
+	{
+		errno = EOPNOTSUPP; // devices, fifos and sockets are not copied
+		return -1;
+	}
+	if (result == 0)
+	{
+		struct timespec times[2] = {st.st_atim, st.st_mtim};
+		utimensat(AT_FDCWD, dest, times, AT_SYMLINK_NOFOLLOW);
+	}
+	return result;
+}
+
+// Percent-encode the bytes of a path that would break the line based .trashinfo format
+void trashinfo_encode(char *out, size_t size, const char *path)
+{
+	size_t len = 0;
+	for (; *path && len + 4 < size; ++path)
+	{
+		if ((unsigned char)*path < 0x20 || *path == '%')
+			len += sprintf(out + len, "%%%02X", (unsigned char)*path);
+		else
+			out[len++] = *path;
+	}
+	out[len] = 0;
+}
+
+void trashinfo_decode(char *s)
+{
+	char *out = s;
+	for (; *s; ++s)
+	{
+		unsigned int c;
+		if (s[0] == '%' && sscanf(s + 1, "%2X", &c) == 1)
+		{
+			*out++ = c;
+			s += 2;
+		}
+		else
+			*out++ = *s;
+	}
+	*out = 0;
+}
+
+// An entry of the trash, read from its .trashinfo file
+struct trash_entry
+{
+	char id[NAME_MAX + 1];
+	char path[PATH_MAX]; // original path, relative for entries of the old trash layout
+	char date[32];
+	char blob[65]; // empty for entries that are not regular files
+	// the file as it was trashed, entries sharing a blob also share an inode
+	bool has_metadata; // false for entries of older versions
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	struct timespec times[2]; // access and modification
+};
+
+// Read the .trashinfo of an entry, returns false when it is missing or has a field too long to hold
+bool trash_read_info(const char *id, struct trash_entry *e)
+{
+	char file[NAME_MAX + 16], line[PATH_MAX * 3 + 32]; // paths are percent-encoded
+	char info[PATH_MAX];
+	memset(e, 0, sizeof(*e));
+	if (snprintf(file, sizeof(file), "%s.trashinfo", id) >= (int)sizeof(file) ||
+		snprintf(e->id, sizeof(e->id), "%s", id) >= (int)sizeof(e->id) || !trash_path(info, sizeof(info), "info", file))
+		return false;
+	FILE *f = fopen(info, "r");
+	if (!f)
+		return false;
+	bool ok = true;
+	unsigned int mode = 0, fields = 0;
+	long long atime = 0, mtime = 0;
+	while (ok && fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\n")] = 0;
+		if (strncmp(line, "Path=", 5) == 0)
+		{
+			trashinfo_decode(line + 5);
+			ok = snprintf(e->path, sizeof(e->path), "%s", line + 5) < (int)sizeof(e->path);
+		}
+		else if (strncmp(line, "DeletionDate=", 13) == 0)
+			ok = snprintf(e->date, sizeof(e->date), "%s", line + 13) < (int)sizeof(e->date);
+		else if (strncmp(line, "Blob=", 5) == 0)
+			ok = snprintf(e->blob, sizeof(e->blob), "%s", line + 5) < (int)sizeof(e->blob);
+		else if (sscanf(line, "Mode=%o", &mode) == 1)
+			fields |= 1;
+		else if (sscanf(line, "Owner=%u:%u", &e->uid, &e->gid) == 2)
+			fields |= 2;
+		else if (sscanf(line, "Accessed=%lld.%ld", &atime, &e->times[0].tv_nsec) == 2)
+			fields |= 4;
+		else if (sscanf(line, "Modified=%lld.%ld", &mtime, &e->times[1].tv_nsec) == 2)
+			fields |= 8;
+	}
+	fclose(f);
+	e->has_metadata = fields == 15;
+	e->mode = mode;
+	e->times[0].tv_sec = atime;
+	e->times[1].tv_sec = mtime;
+	return ok;
+}
+
+int compare_trash_entries(const void *a, const void *b)
+{
+	const struct trash_entry *x = a, *y = b;
+	int c = strcmp(x->date, y->date);
+	return c ? c : strcmp(x->id, y->id);
+}
+
+bool trash_store_file(const char *source, const char *display_path, const struct stat *st);
+
+// Bring files left in ~/.trash by the old layout into the store
+void trash_migrate()
+{
+	char root[PATH_MAX];
+	trash_path(root, sizeof(root), "", "");
+	DIR *dir = opendir(root);
+	if (!dir)
+		return;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (ent->d_name[0] == '.' || strcmp(ent->d_name, "blobs") == 0 || strcmp(ent->d_name, "files") == 0 ||
+			strcmp(ent->d_name, "info") == 0)
+			continue;
+		char path[PATH_MAX];
+		struct stat st;
+		if (snprintf(path, sizeof(path), "%s/%s", root, ent->d_name) >= (int)sizeof(path))
+			continue;
+		if (lstat(path, &st) == 0)
+			trash_store_file(path, ent->d_name, &st); // restored into the working directory, as before
+	}
+	closedir(dir);
+}
+
+/**
+ * Load every entry of the trash, oldest first
+ * @param  count receives the number of entries
+ * @return       array to free
+ */
+struct trash_entry *trash_entries(int *count)
+{
+	trash_migrate();
+	char info[PATH_MAX];
+	trash_path(info, sizeof(info), "info", "");
+	DIR *dir = opendir(info);
+	struct trash_entry *entries = NULL;
+	int capacity = 0;
+	*count = 0;
+	if (!dir)
+		return NULL;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL)
+	{
+		char *suffix = strstr(ent->d_name, ".trashinfo");
+		if (!suffix || suffix[10] != 0)
+			continue;
+		if (*count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			entries = realloc(entries, sizeof(struct trash_entry) * capacity);
+		}
+		*suffix = 0;
+		if (trash_read_info(ent->d_name, &entries[*count]))
+			(*count)++;
+	}
+	closedir(dir);
+	if (*count > 0)
+		qsort(entries, *count, sizeof(struct trash_entry), compare_trash_entries);
+	return entries;
+}
+
+int remove_tree_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	return remove(path);
+}
+
+// Remove the file of an entry, and its blob when no other entry uses it
+void trash_drop(struct trash_entry *e)
+{
+	char path[PATH_MAX];
+	trash_path(path, sizeof(path), "files", e->id);
+	nftw(path, remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS);
+	if (e->blob[0])
+	{
+		struct stat st;
+		trash_path(path, sizeof(path), "blobs", e->blob);
+		if (stat(path, &st) == 0 && st.st_nlink == 1)
+			unlink(path);
+	}
+	char name[NAME_MAX + 16];
+	snprintf(name, sizeof(name), "%s.trashinfo", e->id);
+	trash_path(path, sizeof(path), "info", name);
+	unlink(path);
+}
+
+// List the entries of the trash with their deletion date
+void list_trash()
+{
+	int count;
+	struct trash_entry *entries = trash_entries(&count);
+	for (int i = 0; i < count; ++i)
+		printf("%s  %s\n", entries[i].date, entries[i].path);
+	free(entries);
+}
+
+// Delete every entry of the trash
+void empty_trash()
+{
+	char path[PATH_MAX];
+	const char *subs[] = {"files", "info", "blobs"};
+	trash_migrate();
+	for (int i = 0; i < 3; ++i)
+	{
+		trash_path(path, sizeof(path), subs[i], "");
+		nftw(path, remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS);
+		mkdir(path, 0700);
+	}
+}
+
+// Give a restored file the owner, mode and times it was trashed with, which
+// the stored inode only has for the first entry of its contents
+void trash_apply_metadata(const struct trash_entry *e)
+{
+	if (!e->has_metadata)
+		return;
+	if (lchown(e->path, e->uid, e->gid) == -1 && errno != EPERM) // only root can give files away
+		printf("-%s: trash: %s: %s\n", sysname, e->path, strerror(errno));
+	if (!S_ISLNK(e->mode))
+		chmod(e->path, e->mode & 07777);
+	utimensat(AT_FDCWD, e->path, e->times, AT_SYMLINK_NOFOLLOW);
+}
+
+/**
+ * Put an entry back at its original path. The last entry using a blob
+ * takes the blob itself, the others get a clone or a copy so that the
+ * restored file does not share its inode with the store.
+ * @return true on success
+ */
+bool trash_restore_entry(struct trash_entry *e)
+{
+	char file[PATH_MAX], blob[PATH_MAX];
+	struct stat st;
+	trash_path(file, sizeof(file), "files", e->id);
+	if (lstat(e->path, &st) == 0)
+	{
+		printf("-%s: trash: %s already exists\n", sysname, e->path);
+		return false;
+	}
+
+	bool shared = false;
+	if (e->blob[0])
+	{
+		trash_path(blob, sizeof(blob), "blobs", e->blob);
+		shared = stat(blob, &st) == 0 && st.st_nlink > 2; // the blob, this entry and another one
+	}
+	if (!shared && rename(file, e->path) == 0)
+	{
+		if (e->blob[0])
+			unlink(blob);
+	}
+	else
+	{
+		if (!shared && errno != EXDEV)
+		{
+			printf("-%s: trash: %s: %s\n", sysname, e->path, strerror(errno));
+			return false;
+		}
+		if (copy_tree(file, e->path) == -1)
+		{
+			int error = errno;
+			printf("-%s: trash: %s: %s\n", sysname, e->path, strerror(error));
+			if (error != EEXIST)
+				nftw(e->path, remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS); // the part that was copied
+			return false;
+		}
+	}
+	trash_apply_metadata(e);
+	trash_drop(e); // removes what is left of the entry
+	return true;
+}
+
+/**
+ * Let the user pick entries of the trash, newest first
+ * @param  title   shown by the picker
+ * @param  entries receives the entries of the trash, to free
+ * @param  picked  receives the flags of the picked entries, to free
+ * @return         number of entries picked
+ */
+int pick_trash_entries(const char *title, struct trash_entry **entries, bool **picked)
+{
+	int count;
+	*entries = trash_entries(&count);
+	char **items = malloc(sizeof(char *) * (count + 1));
+	struct trash_entry *e = *entries;
+	for (int i = 0; i < count; ++i)
+	{
+		items[i] = malloc(strlen(e[count - 1 - i].path) + sizeof(e->date) + 2);
+		sprintf(items[i], "%s  %s", e[count - 1 - i].date, e[count - 1 - i].path);
+	}
+	bool *selected = malloc(sizeof(bool) * (count + 1));
+	*picked = calloc(count + 1, sizeof(bool));
+	int n = 0;
+	if (count == 0)
+		printf("Trash is empty\n");
+	else
+		n = pick(title, items, count, true, selected);
+	for (int i = 0; i < count; ++i)
+	{
+		(*picked)[count - 1 - i] = selected[i];
+		free(items[i]);
+	}
+	free(items);
+	free(selected);
+	return n;
+}
+
+// Restore files from the trash to the path they were deleted from
+// Returns false when nothing was picked or a file could not be restored
+bool restore_from_trash()
+{
+	struct trash_entry *entries;
+	bool *picked;
+	int count = pick_trash_entries("restore", &entries, &picked), done = 0;
+	bool ok = count > 0;
+	for (int i = 0; done < count; ++i)
+	{
+		if (!picked[i])
+			continue;
+		done++;
+		if (trash_restore_entry(&entries[i]))
+			printf("%s\n", entries[i].path);
+		else
+			ok = false;
+	}
+	free(entries);
+	free(picked);
+	return ok;
+}
+
+// Delete files from the trash, and their contents if no other entry shares them
+// Returns false when nothing was picked
+bool delete_from_trash()
+{
+	struct trash_entry *entries;
+	bool *picked;
+	int count = pick_trash_entries("delete", &entries, &picked), done = 0;
+	for (int i = 0; done < count; ++i)
+	{
+		if (!picked[i])
+			continue;
+		done++;
+		trash_drop(&entries[i]);
+	}
+	free(entries);
+	free(picked);
+	return count > 0;
+}
+
+/**
+ * Move a file into the store. Regular files are renamed into files/ when the
+ * trash is on the same file system and copied otherwise, hashed on the way,
+ * and then linked to the blob of their contents.
+ * @param  source       the file to trash
+ * @param  display_path path recorded in the .trashinfo
+ * @param  st           lstat of source
+ * @return              true on success
+ */
+bool trash_store_file(const char *source, const char *display_path, const struct stat *st)
+{
+	char root[PATH_MAX], dir[PATH_MAX];
+	const char *subs[] = {"", "files", "info", "blobs"};
+	for (int i = 0; i < 4; ++i)
+	{
+		trash_path(dir, sizeof(dir), subs[i], "");
+		mkdir(dir, 0700);
+	}
+	trash_path(root, sizeof(root), "", "");
+
+	// reserve an id: the base name, then name.2, name.3, ...
+	const char *base = strrchr(display_path, '/') ? strrchr(display_path, '/') + 1 : display_path;
+	char id[NAME_MAX + 1], info[PATH_MAX], name[NAME_MAX + 16];
+	int info_fd = -1;
+	for (int n = 1; info_fd < 0 && n < 100000; ++n)
+	{
+		if (n == 1)
+			snprintf(id, sizeof(id), "%.200s", base);
+		else
+			snprintf(id, sizeof(id), "%.200s.%d", base, n);
+		snprintf(name, sizeof(name), "%s.trashinfo", id);
+		if (!trash_path(info, sizeof(info), "info", name))
+		{
+			errno = ENAMETOOLONG;
+			break;
+		}
+		info_fd = open(info, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (info_fd < 0 && errno != EEXIST)
+			break;
+	}
+	if (info_fd < 0)
+	{
+		printf("-%s: trash: %s: %s\n", sysname, info, strerror(errno));
+		return false;
+	}
+
+	char file[PATH_MAX], blob[PATH_MAX], hex[65] = "";
+	struct stat trash_st;
+	trash_path(file, sizeof(file), "files", id);
+	stat(root, &trash_st);
+	bool same_fs = trash_st.st_dev == st->st_dev;
+	bool ok = true;
+
+	if (S_ISREG(st->st_mode))
+	{
+		struct sha256 hash;
+		sha256_init(&hash);
+		int in = open(source, O_RDONLY | O_CLOEXEC);
+		if (same_fs && st->st_nlink == 1)
+		{
+			// keep the inode, only read it to hash
+			ok = in >= 0 && copy_contents(in, -1, &hash) == 0 && rename(source, file) == 0;
+		}
+		else
+		{
+			// another file system, or other links would share the blob: copy
+			int out = open(file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st->st_mode & 07777);
+			ok = in >= 0 && out >= 0 && copy_contents(in, out, &hash) == 0;
+			if (out >= 0)
+			{
+				struct timespec times[2] = {st->st_atim, st->st_mtim};
+				futimens(out, times);
+				close(out);
+			}
+			ok = ok && unlink(source) == 0;
+			if (!ok)
+				unlink(file);
+		}
+		if (in >= 0)
+			close(in);
+
+		if (ok)
+		{
+			sha256_hex(&hash, hex);
+			trash_path(blob, sizeof(blob), "blobs", hex);
+			if (link(file, blob) == -1)
+			{
+				// the contents are already stored, share them: link the blob next to the
+				// copy and swap it in, so that the copy stays when the blob can not take
+				// another link
+				char temp[PATH_MAX + 8];
+				snprintf(temp, sizeof(temp), "%s.link", file);
+				if (errno != EEXIST || link(blob, temp) == -1)
+					hex[0] = 0; // keep the copy, not tied to any blob
+				else if (rename(temp, file) == -1)
+				{
+					unlink(temp);
+					hex[0] = 0;
+				}
+			}
+		}
+	}
+	else
+	{
+		ok = rename(source, file) == 0;
+		if (!ok && errno == EXDEV)
+		{
+			// another file system: copy the tree into the trash, then remove the original
+			ok = copy_tree(source, file) == 0;
+			if (!ok)
+			{
+				int error = errno;
+				nftw(file, remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS);
+				errno = error;
+			}
+			else if (nftw(source, remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS) != 0)
+				printf("-%s: trash: %s: %s, the trash has a full copy\n", sysname, source, strerror(errno));
+		}
+	}
+
+	if (!ok)
+	{
+		printf("-%s: trash: %s: %s\n", sysname, source, strerror(errno));
+		close(info_fd);
+		unlink(info);
+		return false;
+	}
+
+	char date[32], encoded[PATH_MAX * 3];
+	time_t now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	trashinfo_encode(encoded, sizeof(encoded), display_path);
+	dprintf(info_fd, "[Trash Info]\nPath=%s\nDeletionDate=%s\nBlob=%s\n", encoded, date, hex);
+	dprintf(info_fd, "Mode=%o\nOwner=%u:%u\nAccessed=%lld.%09ld\nModified=%lld.%09ld\n", st->st_mode, st->st_uid,
+			st->st_gid, (long long)st->st_atim.tv_sec, st->st_atim.tv_nsec, (long long)st->st_mtim.tv_sec,
+			st->st_mtim.tv_nsec);
+	close(info_fd);
+	return true;
+}
+
+// Move a file to the trash, returns true on success
+bool move_to_trash(char *file_name)
+{
+	struct stat st;
+	if (lstat(file_name, &st) == -1)
+	{
+		printf("-%s: trash: %s: %s\n", sysname, file_name, strerror(errno));
+		return false;
+	}
+	char path[PATH_MAX];
+	if (file_name[0] == '/')
+		snprintf(path, sizeof(path), "%s", file_name);
+	else
+	{
+		if (!getcwd(path, sizeof(path)))
+			path[0] = 0;
+		size_t len = strlen(path);
+		snprintf(path + len, sizeof(path) - len, "/%s", file_name);
+	}
+	return trash_store_file(file_name, path, &st);
+}
+
+// Trash command
+int trash(struct command_t *command)
+{
+	if (command->arg_count == 0)
+	{
+		printf("Usage: trash [OPTION]... [FILE]...\n");
+		printf("Try 'trash --help' for more information.\n");
+		return FAILURE;
+	}
+	if (strcmp(command->args[0], "--help") == 0)
+	{
+		printf("Usage: trash [OPTION]... [FILE]...\n");
+		printf("Move files to the trash.\n");
+		printf("\n");
+		printf("  --help     display this help and exit\n");
+		printf("  --list     list the files in trash with their original path\n");
+		printf("  --empty    delete every file in trash\n");
+		printf("  --restore  restore a file from trash to its original path\n");
+		printf("  --delete   delete a file from trash\n");
+		printf("  --move     move files to trash\n");
+		printf("\n");
+		printf("Files with the same contents are stored once in ~/.trash/blobs.\n");
+		return SUCCESS;
+	}
+	else if (strcmp(command->args[0], "--list") == 0)
+	{
+		// List all files in the trash
+		list_trash();
+		return SUCCESS;
+	}
+	else if (strcmp(command->args[0], "--empty") == 0)
+	{
+		// Empty the trash
+		empty_trash();
+		return SUCCESS;
+	}
+	else if (strcmp(command->args[0], "--restore") == 0)
+	{
+		// Restore a file from the trash
+		return restore_from_trash() ? SUCCESS : FAILURE;
+	}
+	else if (strcmp(command->args[0], "--delete") == 0)
+	{
+		// Remove a file from the trash
+		return delete_from_trash() ? SUCCESS : FAILURE;
+	}
+	else if (strcmp(command->args[0], "--move") == 0)
+	{
+		// Move the files to the trash
+		int code = command->arg_count > 1 ? SUCCESS : FAILURE;
+		for (int i = 1; i < command->arg_count && command->args[i]; ++i)
+			if (!move_to_trash(command->args[i]))
+				code = FAILURE;
+		return code;
+	}
+	else
+	{
+		printf("Usage: trash [OPTION]... [FILE]...\n");
+		printf("Try 'trash --help' for more information.\n");
+		return FAILURE;
+	}
+}
+
+// Fetch joke from https://icanhazdadjoke.com using curl and notifiy the user using notify-send every 15 minutes using crontab
+int joker(struct command_t *command)
+{
+
+	// No args means wrong input
+	if (command->args[0] == NULL)
+	{
+		printf("Invalid input\n");
+		printf("Usage: joker start/stop\n");
+		return FAILURE;
+	}
+
+	// If it is a valid command, clean the crontab
+	if (strcmp(command->args[0], "stop") == 0 || strcmp(command->args[0], "start") == 0)
+	{
+		system("crontab -l > crontab");
+		FILE *f = fopen("crontab", "w");
+		fprintf(f, " ");
+		fclose(f);
+		system("crontab crontab");
+	}
+
+	if (strcmp(command->args[0], "start") == 0)
+	{
+		int every_x_minutes = 15;
+		// If the user specified a valid frequency, use that instead
+		if (command->args[1] != NULL)
+			every_x_minutes = atoi(command->args[1]) ? atoi(command->args[1]) : 15;
+
+		printf("%s", command->args[1]);
+		// Create joker.sh file in User directory
+		char *home = getenv("HOME");
+		char *joker_file = malloc(strlen(home) + strlen("/joker.sh") + 1);
+		strcpy(joker_file, home);
+		strcat(joker_file, "/joker.sh");
+
+		// Write fetch and notify-send commands to joker.sh
+		FILE *f = fopen(joker_file, "w");
+		fprintf(f, "#!/bin/bash\n");
+		fprintf(f, "IP_MSG=\"$(/usr/bin/curl -s https://icanhazdadjoke.com 2>&1)\"\n");
+		fprintf(f, "STATUS=$?\n\n");
+		fprintf(f, "ICON=\"face-laugh\"\n\n");
+		fprintf(f, "if [ $STATUS -ne 0 ]; then\n");
+		fprintf(f, "    MESSAGE=\"Error Occurred! [ $IP_MSG ]\"\n");
+		fprintf(f, "    ICON=\"dialog-error\"\n");
+		fprintf(f, "else\n");
+		fprintf(f, "    MESSAGE=\"$IP_MSG\"\n");
+		fprintf(f, "fi\n\n");
+		fprintf(f, "XDG_RUNTIME_DIR=/run/user/$(id -u) notify-send -t 4000 -i \"$ICON\" \"Ha ha ha\" \"$MESSAGE\"\n");
+		fclose(f);
+
+		// Make joker.sh executable
+		chmod(joker_file, S_IRWXU);
+
+		// Create crontab file in User directory
+		char *crontab_file = malloc(strlen(home) + strlen("/crontab") + 1);
+		strcpy(crontab_file, home);
+		strcat(crontab_file, "/crontab");
+
+		f = fopen(crontab_file, "w");
+		fprintf(f, "* * * * * %s\n", joker_file);
+		fclose(f);
+
+		// Add joker.sh to crontab
+		system("crontab -l > crontab");
+		f = fopen("crontab", "a");
+		fprintf(f, "*/%d * * * * %s\n", every_x_minutes, joker_file);
+		fclose(f);
+		system("crontab crontab");
+		free(crontab_file);
+		free(joker_file);
+	}
+	else
+	{
+		// Other args are invalid
+		printf("Invalid input\n");
+		printf("Usage: joker start/stop\n");
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+// Check /sys/module instead of remembering whether we ran insmod, so an already
+// loaded module (by another shell or at boot) is reused without spawning sudo.
+bool module_loaded()
+{
+	return access("/sys/module/my_module", F_OK) == 0;
+}
+
+// Load my_module.ko from the current directory. finit_module works directly when
+// the shell has CAP_SYS_MODULE, otherwise fall back to asking for sudo.
+int load_module()
+{
+	int fd = open("my_module.ko", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		printf("-%s: my_module.ko: %s\n", sysname, strerror(errno));
+		return -1;
+	}
+	int r = syscall(SYS_finit_module, fd, "", 0);
+	int err = errno;
+	close(fd);
+
+	if (r == 0)
+	{
+		moduleInstalled = 1;
+		return 0;
+	}
+	if (err == EEXIST) // loaded concurrently by someone else
+		return 0;
+	if (err != EPERM)
+	{
+		printf("-%s: my_module.ko: %s\n", sysname, strerror(err));
+		return -1;
+	}
+	if (system("sudo insmod my_module.ko") != 0)
+		return module_loaded() ? 0 : -1;
+	moduleInstalled = 1;
+	return 0;
+}
+
+// Return the cached descriptor of the device, loading the module on first use
+int open_module_device()
+{
+	if (moduleFd >= 0)
+		return moduleFd;
+	if (!module_loaded() && load_module() < 0)
+		return -1;
+	moduleFd = open(PS_DEVICE, O_RDWR | O_CLOEXEC);
+	return moduleFd;
+}
+
+// Called when the shell exits. The module is only removed if this shell loaded it,
+// so concurrent shells keep using it.
+void unload_module()
+{
+	if (moduleFd >= 0)
+	{
+		close(moduleFd);
+		moduleFd = -1;
+	}
+	if (!moduleInstalled)
+		return;
+	if (syscall(SYS_delete_module, "my_module", O_NONBLOCK) < 0 && errno == EPERM)
+		system("sudo rmmod my_module");
+	moduleInstalled = 0;
+}
+
+// Print the totals of PS_SUM over the subtree selected by args
+int pstraverse_sum(int fd, struct ps_traverse_args *args)
+{
+	struct ps_sum_args sum;
+	memset(&sum, 0, sizeof(sum));
+	sum.pid = args->pid;
+	sum.max_depth = args->max_depth;
+	if (ioctl(fd, PS_SUM, &sum) < 0)
+	{
+		printf("-%s: pstraverse: %s\n", sysname, strerror(errno));
+		return FAILURE;
+	}
+	printf("processes: %u\n", sum.processes);
+	printf("threads:   %u\n", sum.threads);
+	printf("rss:       %.1f MiB\n", sum.rss_bytes / (1024.0 * 1024.0));
+	printf("utime:     %.3f s\n", sum.utime_ns / 1e9);
+	printf("stime:     %.3f s\n", sum.stime_ns / 1e9);
+	printf("open fds:  %u\n", sum.open_fds);
+	if (sum.flags & PS_TRUNCATED)
+		printf("(subtree too large, totals are partial)\n");
+	return SUCCESS;
+}
+
+// When the command is called for the first time, shellfyre will prompt sudo password
+// to load the module into the kernel. After the module is loaded by the first call,
+// the tree traversal operation on the targeted PID will run. Successive calls to the
+// command will not load the module again. They will only invoke tree traversal
+// operations by on targeted PIDs. In the first call of the command, the traversal
+// operation can be run by the initialization function of the kernel module. In the
+// following calls, you can use ioctl function calls to trigger the operations.
+// shellfyre should remove the module from kernel when the shell is exited.
+//
+void pstraverse_print(struct ps_node *nodes, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		char state = '?';
+		if (nodes[i].state == PS_STATE_RUNNING)
+			state = 'R';
+		else if (nodes[i].state == PS_STATE_DSTATE)
+			state = 'D';
+		else if (nodes[i].state == PS_STATE_ZOMBIE)
+			state = 'Z';
+		else if (nodes[i].state == PS_STATE_OTHER)
+			state = 'S';
+		printf("%*stask: %s, pid: %d, ppid: %d, state: %c\n",
+			   nodes[i].depth * 2, "", nodes[i].comm, nodes[i].pid, nodes[i].ppid, state);
+	}
+}
+
+// Say why a traversal stopped early, raising --limit only helps when the limit was reached
+void pstraverse_truncated(uint32_t flags, uint32_t count, uint32_t limit)
+{
+	if (flags & PS_QUEUE_FULL)
+		printf("(stopped after %u tasks, too many tasks were waiting in the module's queue)\n", count);
+	if ((flags & PS_TRUNCATED) && count >= limit)
+		printf("(stopped after %u tasks, raise --limit to see more)\n", count);
+}
+
+/**
+ * Walk several roots with a single PS_BATCH call and print the tasks of each
+ * @param  fd    the device
+ * @param  args  filters shared by the roots
+ * @param  pids  the roots
+ * @param  count number of pids
+ * @param  dfs   depth first instead of breadth first
+ */
+int pstraverse_batch(int fd, struct ps_traverse_args *args, int *pids, int count, bool dfs)
+{
+	struct ps_batch_root *roots = calloc(count, sizeof(struct ps_batch_root));
+	struct ps_node *nodes = malloc(sizeof(struct ps_node) * args->limit);
+	struct ps_batch_args batch;
+	memset(&batch, 0, sizeof(batch));
+	for (int i = 0; i < count; ++i)
+		roots[i].pid = pids[i];
+	batch.roots = (uintptr_t)roots;
+	batch.root_count = count;
+	batch.dfs = dfs;
+	batch.max_depth = args->max_depth;
+	batch.state_mask = args->state_mask;
+	memcpy(batch.comm, args->comm, PS_COMM_LEN);
+	batch.nodes = (uintptr_t)nodes;
+	batch.limit = args->limit;
+	int code = SUCCESS;
+
+	if (ioctl(fd, PS_BATCH, &batch) < 0)
+	{
+		printf("-%s: pstraverse: %s\n", sysname, strerror(errno));
+		code = FAILURE;
+	}
+	else
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			printf("%spid %d:\n", i > 0 ? "\n" : "", roots[i].pid);
+			if (roots[i].error)
+			{
+				printf("-%s: pstraverse: %d: %s\n", sysname, roots[i].pid, strerror(-roots[i].error));
+				code = FAILURE;
+			}
+			else if (roots[i].covered_by >= 0)
+				printf("(inside the tree of pid %d above)\n", roots[roots[i].covered_by].pid);
+			else
+				pstraverse_print(nodes + roots[i].first, roots[i].count);
+		}
+		pstraverse_truncated(batch.flags, batch.count, batch.limit);
+	}
+	free(nodes);
+	free(roots);
+	return code;
+}
+
+// Usage: pstraverse PID... [-b|-d] [--depth N] [--comm NAME] [--state RDZ] [--limit N]
+//        pstraverse PID... --sum [--depth N]
+// The filters are evaluated by the kernel module so only matching tasks are copied out.
+// With several PIDs every tree is walked in a single PS_BATCH call, and a PID that is
+// already inside the tree of another one is not walked twice.
+// --sum prints the resource usage aggregated over the subtree instead of the tasks.
+int pstraverse(struct command_t *command)
+{
+	// the PIDs come first, up to the first option
+	int pid_count = 0;
+	while (pid_count < command->arg_count && atoi(command->args[pid_count]) > 0)
+		pid_count++;
+	if (pid_count == 0 || pid_count > PS_MAX_ROOTS)
+	{
+		printf("Invalid input\n");
+		return FAILURE;
+	}
+	int *pids = malloc(sizeof(int) * pid_count);
+	for (int i = 0; i < pid_count; ++i)
+		pids[i] = atoi(command->args[i]);
+
+	struct ps_traverse_args args;
+	memset(&args, 0, sizeof(args));
+	args.pid = pids[0];
+	args.max_depth = -1;
+	args.limit = 4096;
+	unsigned long cmd = PS_DFS;
+	int sum = 0;
+
+	int i;
+	for (i = pid_count; i < command->arg_count; ++i)
+	{
+		char *arg = command->args[i];
+		char *value = i + 1 < command->arg_count ? command->args[i + 1] : NULL;
+		if (strcmp(arg, "-b") == 0)
+			cmd = PS_BFS;
+		else if (strcmp(arg, "-d") == 0)
+			cmd = PS_DFS;
+		else if (strcmp(arg, "--sum") == 0)
+			sum = 1;
+		else if (strcmp(arg, "--depth") == 0 && value)
+		{
+			args.max_depth = atoi(value);
+			i++;
+		}
+		else if (strcmp(arg, "--comm") == 0 && value)
+		{
+			strncpy(args.comm, value, PS_COMM_LEN - 1);
+			i++;
+		}
+		else if (strcmp(arg, "--limit") == 0 && value && atoi(value) > 0)
+		{
+			args.limit = atoi(value) > PS_MAX_NODES ? PS_MAX_NODES : atoi(value);
+			i++;
+		}
+		else if (strcmp(arg, "--state") == 0 && value)
+		{
+			// any combination of R (running), D (uninterruptible) and Z (zombie)
+			for (char *s = value; *s; ++s)
+			{
+				if (*s == 'R')
+					args.state_mask |= PS_STATE_RUNNING;
+				else if (*s == 'D')
+					args.state_mask |= PS_STATE_DSTATE;
+				else if (*s == 'Z')
+					args.state_mask |= PS_STATE_ZOMBIE;
+				else
+				{
+					printf("Invalid state: %c\n", *s);
+					free(pids);
+					return FAILURE;
+				}
+			}
+			i++;
+		}
+		else
+		{
+			printf("Usage: pstraverse PID... [-b|-d] [--depth N] [--comm NAME] [--state RDZ] [--limit N]\n");
+			printf("       pstraverse PID... --sum [--depth N]\n");
+			free(pids);
+			return FAILURE;
+		}
+	}
+
+	int fd = open_module_device();
+	if (fd < 0)
+	{
+		printf("Error opening device file\n");
+		free(pids);
+		return FAILURE;
+	}
+
+	int code = SUCCESS;
+	if (sum)
+	{
+		for (i = 0; i < pid_count; ++i)
+		{
+			if (pid_count > 1)
+				printf("%spid %d:\n", i > 0 ? "\n" : "", pids[i]);
+			args.pid = pids[i];
+			if (pstraverse_sum(fd, &args) == FAILURE)
+				code = FAILURE;
+		}
+		free(pids);
+		return code;
+	}
+	if (pid_count > 1)
+	{
+		code = pstraverse_batch(fd, &args, pids, pid_count, cmd == PS_DFS);
+		free(pids);
+		return code;
+	}
+	free(pids);
+
+	struct ps_node *nodes = malloc(sizeof(struct ps_node) * args.limit);
+	args.nodes = (uintptr_t)nodes;
+	if (ioctl(fd, cmd, &args) < 0)
+	{
+		printf("-%s: pstraverse: %s\n", sysname, strerror(errno));
+		code = FAILURE;
+	}
+	else
+	{
+		pstraverse_print(nodes, args.count);
+		pstraverse_truncated(args.flags, args.count, args.limit);
+	}
+	free(nodes);
+
+	return code;
+}
+
+volatile sig_atomic_t pswatch_interrupted = 0;
+
+void pswatch_sigint(int sig)
+{
+	pswatch_interrupted = 1;
+}
+
+// Usage: pswatch PID
+// Tails the fork and exit events of every process under PID until Ctrl+C.
+// The kernel module pushes the events from tracepoints into a ring buffer that
+// belongs to this file descriptor, so short lived processes are not missed.
+int pswatch(struct command_t *command)
+{
+	if (command->arg_count != 1 || atoi(command->args[0]) <= 0)
+	{
+		printf("Usage: pswatch PID\n");
+		return FAILURE;
+	}
+
+	// the cached descriptor makes sure the module is loaded, each watch gets its own ring
+	if (open_module_device() < 0)
+	{
+		printf("Error opening device file\n");
+		return FAILURE;
+	}
+	int fd = open(PS_DEVICE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		printf("Error opening device file\n");
+		return FAILURE;
+	}
+	struct ps_watch_args args = {.pid = atoi(command->args[0])};
+	if (ioctl(fd, PS_WATCH, &args) < 0)
+	{
+		printf("-%s: pswatch: %s\n", sysname, strerror(errno));
+		close(fd);
+		return FAILURE;
+	}
+
+	// Ctrl+C stops the watch instead of the shell
+	struct sigaction sa, old_sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = pswatch_sigint;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &old_sa);
+	pswatch_interrupted = 0;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t start_ns = start.tv_sec * 1000000000ull + start.tv_nsec;
+
+	struct ps_event events[64];
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	while (!pswatch_interrupted)
+	{
+		if (poll(&pfd, 1, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		ssize_t n = read(fd, events, sizeof(events));
+		if (n < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			break;
+		}
+		for (int i = 0; i < n / (ssize_t)sizeof(struct ps_event); ++i)
+		{
+			struct ps_event *e = &events[i];
+			double t = e->time_ns > start_ns ? (e->time_ns - start_ns) / 1e9 : 0;
+			if (e->type == PS_EVENT_FORK)
+				printf("[%10.6f] fork pid: %d, ppid: %d, task: %s\n", t, e->pid, e->ppid, e->comm);
+			else if (e->type == PS_EVENT_EXIT)
+				printf("[%10.6f] exit pid: %d, ppid: %d, task: %s, status: %d\n", t, e->pid, e->ppid, e->comm,
+					   WIFEXITED(e->status) ? WEXITSTATUS(e->status) : 128 + WTERMSIG(e->status));
+			else if (e->type == PS_EVENT_LOST)
+				printf("[%10.6f] lost %d events\n", t, e->status);
+		}
+		fflush(stdout);
+	}
+
+	sigaction(SIGINT, &old_sa, NULL);
+	close(fd);
+	printf("\n");
+	return SUCCESS;
+}
+
+// Forks a synthetic process tree below the calling process: every node forks
+// fanout children until depth levels, reports on ready_fd and sleeps.
+// A node writes "x" once its children are forked, or "!" and the errno of a
+// failed fork, then closes ready_fd so that the reader sees EOF when all are done.
+void psbench_grow(int depth, int fanout, int ready_fd)
+{
+	int i = 0;
+	while (depth > 0 && i < fanout)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			// the child becomes a node one level down
+			depth--;
+			i = 0;
+			continue;
+		}
+		if (pid == -1)
+		{
+			char failed[2] = {'!', errno};
+			write(ready_fd, failed, 2);
+			break;
+		}
+		i++;
+	}
+	write(ready_fd, "x", 1);
+	close(ready_fd);
+	while (1)
+		pause();
+}
+
+int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Runs the PS_BENCH ioctl runs times and prints latency percentiles
+void psbench_report(int fd, pid_t root, int dfs, int runs)
+{
+	uint64_t *samples = malloc(sizeof(uint64_t) * runs);
+	struct ps_bench_args bench;
+	int i;
+	for (i = 0; i < runs; ++i)
+	{
+		memset(&bench, 0, sizeof(bench));
+		bench.pid = root;
+		bench.dfs = dfs;
+		if (ioctl(fd, PS_BENCH, &bench) < 0)
+		{
+			printf("-%s: psbench: %s\n", sysname, strerror(errno));
+			free(samples);
+			return;
+		}
+		samples[i] = bench.elapsed_ns;
+	}
+	qsort(samples, runs, sizeof(uint64_t), compare_u64);
+	printf("%s: visited %u, p50 %lu ns, p90 %lu ns, p99 %lu ns, max %lu ns, %.1f ns/task%s\n",
+		   dfs ? "dfs" : "bfs", bench.visited,
+		   (unsigned long)samples[runs / 2], (unsigned long)samples[runs * 90 / 100],
+		   (unsigned long)samples[runs * 99 / 100], (unsigned long)samples[runs - 1],
+		   bench.visited ? (double)samples[runs / 2] / bench.visited : 0,
+		   bench.flags & PS_TRUNCATED ? " (truncated)" : "");
+	free(samples);
+}
+
+// Usage: psbench [--depth D] [--fanout F] [--runs N]
+// Builds a synthetic process tree and measures bfs and dfs over it with the
+// test mode of the kernel module. Meant for a VM or container kernel.
+int psbench(struct command_t *command)
+{
+	int depth = 3, fanout = 4, runs = 1000;
+	int i;
+	for (i = 0; i + 1 < command->arg_count; i += 2)
+	{
+		if (strcmp(command->args[i], "--depth") == 0)
+			depth = atoi(command->args[i + 1]);
+		else if (strcmp(command->args[i], "--fanout") == 0)
+			fanout = atoi(command->args[i + 1]);
+		else if (strcmp(command->args[i], "--runs") == 0)
+			runs = atoi(command->args[i + 1]);
+		else
+			break;
+	}
+	if (i != command->arg_count || depth < 0 || fanout < 1 || runs < 1)
+	{
+		printf("Usage: psbench [--depth D] [--fanout F] [--runs N]\n");
+		return FAILURE;
+	}
+
+	long nodes = 1, level = 1;
+	for (i = 0; i < depth && nodes <= 20000; ++i)
+	{
+		level *= fanout;
+		nodes += level;
+	}
+	if (nodes > 20000)
+	{
+		printf("-%s: psbench: tree too large (at most 20000 processes)\n", sysname);
+		return FAILURE;
+	}
+
+	int fd = open_module_device();
+	if (fd < 0)
+	{
+		printf("Error opening device file\n");
+		return FAILURE;
+	}
+
+	int ready[2];
+	if (pipe2(ready, O_CLOEXEC) < 0)
+	{
+		printf("-%s: psbench: %s\n", sysname, strerror(errno));
+		return FAILURE;
+	}
+	pid_t root = fork();
+	if (root == 0)
+	{
+		setpgid(0, 0); // the whole tree can be killed at once
+		close(ready[0]);
+		psbench_grow(depth, fanout, ready[1]);
+	}
+	close(ready[1]);
+	if (root == -1)
+	{
+		printf("-%s: psbench: fork: %s\n", sysname, strerror(errno));
+		close(ready[0]);
+		return FAILURE;
+	}
+
+	char buf[256];
+	long seen = 0;
+	int fork_error = 0;
+	bool error_next = false; // the errno after a "!" may come with the next read
+	ssize_t n;
+	while ((n = read(ready[0], buf, sizeof(buf))) > 0) // until every node closed its end
+	{
+		for (ssize_t i = 0; i < n; ++i)
+		{
+			if (error_next)
+				fork_error = (unsigned char)buf[i];
+			else if (buf[i] == 'x')
+				seen++;
+			error_next = !error_next && buf[i] == '!';
+		}
+	}
+	close(ready[0]);
+
+	if (seen == nodes)
+	{
+		printf("tree: depth %d, fanout %d, %ld processes, %d runs\n", depth, fanout, nodes, runs);
+		psbench_report(fd, root, 0, runs);
+		psbench_report(fd, root, 1, runs);
+	}
+	else
+		printf("-%s: psbench: only %ld of %ld processes started: fork: %s\n", sysname, seen, nodes,
+			   strerror(fork_error));
+
+	kill(-root, SIGKILL);
+	waitpid(root, NULL, 0);
+	return seen == nodes ? SUCCESS : FAILURE;
+}
+
+int builtin_exit(struct command_t *command)
+{
+	return EXIT;
+}
+
+int builtin_cd(struct command_t *command)
+{
+	const char *dir = command->arg_count > 0 ? command->args[0] : getenv("HOME");
+	if (dir == NULL)
+		return SUCCESS;
+	if (chdir(dir) == -1)
+	{
+		printf("-%s: %s: %s: %s\n", sysname, command->name, dir, strerror(errno));
+		return FAILURE;
+	}
+	prompt_cache_refresh();
+	// for the cdh command
+	add_directory_to_history(prompt_cache.cwd);
+	return SUCCESS;
+}
+
+// Resources used by the last command run by process_command
+struct command_usage
+{
+	double wall;	  // seconds
+	struct rusage ru; // of the child for external commands, of the shell for builtins
+};
+struct command_usage last_usage;
+
+#define STATS_BUCKETS 32 // log2 buckets of microseconds, the last one is open ended
+
+// Latencies of every run of one command in this session
+struct command_stats
+{
+	char *name;
+	unsigned long count;
+	double total, min, max; // wall seconds
+	double utime, stime;	// seconds
+	long maxrss;			// KB, the largest seen
+	unsigned long buckets[STATS_BUCKETS];
+	struct command_stats *next;
+};
+
+struct command_stats *stats_list = NULL;
+
+int stats_bucket(double seconds)
+{
+	unsigned long us = seconds * 1e6;
+	int bucket = 0;
+	while (us > 1 && bucket < STATS_BUCKETS - 1)
+	{
+		us >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+double timeval_seconds(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void stats_record(const char *name, struct command_usage *usage)
+{
+	struct command_stats *s;
+	for (s = stats_list; s; s = s->next)
+		if (strcmp(s->name, name) == 0)
+			break;
+	if (!s)
+	{
+		s = calloc(1, sizeof(struct command_stats));
+		s->name = strdup(name);
+		s->min = usage->wall;
+		s->next = stats_list;
+		stats_list = s;
+	}
+	s->count++;
+	s->total += usage->wall;
+	if (usage->wall < s->min)
+		s->min = usage->wall;
+	if (usage->wall > s->max)
+		s->max = usage->wall;
+	s->utime += timeval_seconds(usage->ru.ru_utime);
+	s->stime += timeval_seconds(usage->ru.ru_stime);
+	if (usage->ru.ru_maxrss > s->maxrss)
+		s->maxrss = usage->ru.ru_maxrss;
+	s->buckets[stats_bucket(usage->wall)]++;
+}
+
+// after - before for the counters of a getrusage(RUSAGE_SELF) pair, ru_maxrss is kept
+void rusage_sub(struct rusage *after, const struct rusage *before)
+{
+	timersub(&after->ru_utime, &before->ru_utime, &after->ru_utime);
+	timersub(&after->ru_stime, &before->ru_stime, &after->ru_stime);
+	after->ru_minflt -= before->ru_minflt;
+	after->ru_majflt -= before->ru_majflt;
+	after->ru_nvcsw -= before->ru_nvcsw;
+	after->ru_nivcsw -= before->ru_nivcsw;
+}
+
+// Print seconds with a unit that keeps about three significant digits
+void format_duration(char *buf, size_t size, double seconds)
+{
+	if (seconds < 1e-3)
+		snprintf(buf, size, "%.0fus", seconds * 1e6);
+	else if (seconds < 1)
+		snprintf(buf, size, "%.3gms", seconds * 1e3);
+	else
+		snprintf(buf, size, "%.3gs", seconds);
+}
+
+// Upper bound of the bucket holding the given fraction of the runs
+double stats_percentile(struct command_stats *s, double fraction)
+{
+	unsigned long target = s->count * fraction, seen = 0;
+	for (int i = 0; i < STATS_BUCKETS; ++i)
+	{
+		seen += s->buckets[i];
+		if (seen > target)
+			return (2UL << i) / 1e6 < s->max ? (2UL << i) / 1e6 : s->max;
+	}
+	return s->max;
+}
+
+void stats_histogram(struct command_stats *s)
+{
+	unsigned long most = 0;
+	int first = STATS_BUCKETS, last = 0;
+	for (int i = 0; i < STATS_BUCKETS; ++i)
+	{
+		if (!s->buckets[i])
+			continue;
+		if (s->buckets[i] > most)
+			most = s->buckets[i];
+		if (i < first)
+			first = i;
+		last = i;
+	}
+	printf("%s: %lu runs, user %.3fs, sys %.3fs, max rss %ld KB\n", s->name, s->count, s->utime, s->stime, s->maxrss);
+	printf("%21s : %-8s\n", "usecs", "count");
+	for (int i = first; i <= last; ++i)
+	{
+		char bar[41];
+		int width = s->buckets[i] * 40 / most;
+		memset(bar, '*', width);
+		memset(bar + width, ' ', 40 - width);
+		bar[40] = 0;
+		printf("%10lu -> %-8lu : %-8lu |%s|\n", i ? 1UL << i : 0, (2UL << i) - 1, s->buckets[i], bar);
+	}
+}
+
+int compare_stats(const void *a, const void *b)
+{
+	double x = (*(struct command_stats **)a)->total, y = (*(struct command_stats **)b)->total;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// stats [NAME] [--reset]
+// Without arguments prints a line per command run in this session, slowest in
+// total first. With NAME prints the latency histogram of that command.
+int stats(struct command_t *command)
+{
+	struct command_stats *s;
+	if (command->arg_count > 0 && strcmp(command->args[0], "--reset") == 0)
 	{
-		printf("Invalid input\n");
+		while (stats_list)
+		{
+			s = stats_list->next;
+			free(stats_list->name);
+			free(stats_list);
+			stats_list = s;
+		}
 		return SUCCESS;
 	}
-	while ((getchar()) != '\n')
-		; // Clear the buffer.
+	if (command->arg_count > 0)
+	{
+		for (s = stats_list; s; s = s->next)
+			if (strcmp(s->name, command->args[0]) == 0)
+				break;
+		if (s)
+			stats_histogram(s);
+		else
+			printf("-%s: stats: %s: not run in this session\n", sysname, command->args[0]);
+		return s ? SUCCESS : FAILURE;
+	}
+
+	int count = 0;
+	for (s = stats_list; s; s = s->next)
+		count++;
+	struct command_stats **sorted = malloc(sizeof(struct command_stats *) * (count + 1));
+	count = 0;
+	for (s = stats_list; s; s = s->next)
+		sorted[count++] = s;
+	qsort(sorted, count, sizeof(struct command_stats *), compare_stats);
+
+	printf("%-16s %6s %9s %9s %9s %9s %9s %9s\n", "command", "runs", "total", "mean", "min", "max", "p50<=", "p99<=");
+	for (int i = 0; i < count; ++i)
+	{
+		s = sorted[i];
+		char total[16], mean[16], min[16], max[16], p50[16], p99[16];
+		format_duration(total, sizeof(total), s->total);
+		format_duration(mean, sizeof(mean), s->total / s->count);
+		format_duration(min, sizeof(min), s->min);
+		format_duration(max, sizeof(max), s->max);
+		format_duration(p50, sizeof(p50), stats_percentile(s, 0.5));
+		format_duration(p99, sizeof(p99), stats_percentile(s, 0.99));
+		printf("%-16s %6lu %9s %9s %9s %9s %9s %9s\n", s->name, s->count, total, mean, min, max, p50, p99);
+	}
+	free(sorted);
+	return SUCCESS;
+}
+
+// time COMMAND [ARGS]: run COMMAND and report the resources it used on stderr
+int time_command(struct command_t *command)
+{
+	if (command->arg_count == 0)
+	{
+		printf("Usage: time COMMAND [ARGS]\n");
+		return FAILURE;
+	}
+
+	// the same command without the time prefix, sharing the strings
+	struct command_t timed = *command;
+	timed.name = command->args[0];
+	timed.arg_count = command->arg_count - 1;
+	timed.args = malloc(sizeof(char *) * (timed.arg_count + 1));
+	memcpy(timed.args, command->args + 1, sizeof(char *) * timed.arg_count);
+
+	int code = process_command(&timed);
+	free(timed.args);
+	if (command->background)
+		return code;
+
+	struct rusage *ru = &last_usage.ru;
+	fflush(stdout);
+	fprintf(stderr, "\nreal\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\nmaxrss\t%ld KB\nctxsw\t%ld voluntary, %ld involuntary\n",
+			last_usage.wall, timeval_seconds(ru->ru_utime), timeval_seconds(ru->ru_stime), ru->ru_maxrss,
+			ru->ru_nvcsw, ru->ru_nivcsw);
+	return code;
+}
+
+// Write s as the contents of a JSON string
+void json_escape(FILE *out, const char *s)
+{
+	for (; *s; ++s)
+	{
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+}
+
+// Write the spans of the current session in the Chrome trace event format
+int trace_dump(const char *path)
+{
+	FILE *out = fopen(path, "w");
+	if (!out)
+	{
+		printf("-%s: trace: %s: %s\n", sysname, path, strerror(errno));
+		return -1;
+	}
 
-	// Switch to the directory.
-	strcpy(command->name, "cd");
-	command->arg_count = 1;
-	command->args = malloc(sizeof(char *) * 1);
-	command->args[0] = malloc(strlen(lines[choice]) + 1);
-	for (i = 0; i < strlen(lines[choice]); ++i)
+	unsigned long head = atomic_load_explicit(&trace.head, memory_order_acquire);
+	unsigned long ticket = head - trace.first > TRACE_EVENTS ? head - TRACE_EVENTS : trace.first;
+	int written = 0;
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", getpid(), sysname);
+	for (; ticket < head; ++ticket)
 	{
-		if (lines[choice][i] == '\n')
+		struct trace_event *e = &trace.events[ticket & (TRACE_EVENTS - 1)], copy;
+		if (atomic_load_explicit(&e->seq, memory_order_acquire) != ticket + 1)
+			continue; // overwritten or still being written
+		copy.name = e->name;
+		copy.start_ns = e->start_ns;
+		copy.dur_ns = e->dur_ns;
+		copy.tid = e->tid;
+		memcpy(copy.detail, e->detail, sizeof(copy.detail));
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&e->seq, memory_order_relaxed) != ticket + 1)
+			continue;
+		copy.detail[sizeof(copy.detail) - 1] = 0;
+
+		fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+				copy.name, copy.start_ns / 1e3, copy.dur_ns / 1e3, getpid(), copy.tid);
+		if (copy.detail[0])
 		{
-			lines[choice][i] = '\0';
-			break;
+			fprintf(out, ",\"args\":{\"detail\":\"");
+			json_escape(out, copy.detail);
+			fprintf(out, "\"}");
 		}
+		fprintf(out, "}");
+		written++;
 	}
-	// printf("hello: %s\n", lines[c]+5);
-	strcpy(command->args[0], lines[choice] + 5);
-	process_command(command);
+	fprintf(out, "\n]}\n");
+	fclose(out);
+	printf("%d events written to %s\n", written, path);
+	return 0;
+}
 
+// trace start|stop|dump FILE
+// Records where the time of every command goes, from the prompt to the exit
+// of the child. dump writes a file that chrome://tracing and Perfetto open.
+int trace_command(struct command_t *command)
+{
+	const char *action = command->arg_count > 0 ? command->args[0] : "";
+	if (strcmp(action, "start") == 0)
+	{
+		if (!trace.events)
+			trace.events = calloc(TRACE_EVENTS, sizeof(struct trace_event));
+		trace.first = atomic_load(&trace.head);
+		atomic_store(&trace.enabled, true);
+	}
+	else if (strcmp(action, "stop") == 0)
+		atomic_store(&trace.enabled, false);
+	else if (strcmp(action, "dump") == 0 && command->arg_count > 1)
+		return trace_dump(command->args[1]) < 0 ? FAILURE : SUCCESS;
+	else if (command->arg_count == 0)
+		printf("tracing is %s, %lu spans recorded\n", atomic_load(&trace.enabled) ? "on" : "off",
+			   trace.events ? atomic_load(&trace.head) - trace.first : 0);
+	else
+	{
+		printf("Usage: trace start|stop|dump FILE\n");
+		return FAILURE;
+	}
 	return SUCCESS;
 }
 
-void add_directory_to_history(char *path)
+int list_builtins(struct command_t *command);
+int parallel(struct command_t *command);
+int meminfo(struct command_t *command);
+int load(struct command_t *command);
+int unload(struct command_t *command);
+
+// Every builtin of the shell with its help text. Looked up through builtin_table.
+struct builtin builtins[] = {
+	{"exit", builtin_exit, "exit: leave the shell"},
+	{"cd", builtin_cd, "cd [DIR]: change the working directory, to $HOME without DIR"},
+	{"cdh", cdh, "cdh: pick one of the recently visited directories"},
+	{"take", take, "take DIR: create DIR and its parents and change into it"},
+	{"filesearch", filesearch, "filesearch [-r] [-o] [-c PATTERN] [options] KEYWORD: find files by name and metadata, or lines containing PATTERN"},
+	{"currency", currency, "currency FROM_TO: print the current exchange rate, e.g. USD_TRY"},
+	{"joker", joker, "joker start [MINUTES]|stop: get a joke notification periodically"},
+	{"trash", trash, "trash --move FILE|--list|--restore|--delete|--empty: manage ~/.trash"},
+	{"pstraverse", pstraverse, "pstraverse PID... [-b|-d] [--sum] [filters]: walk the process trees with my_module"},
+	{"pswatch", pswatch, "pswatch PID: stream fork and exit events under PID"},
+	{"psbench", psbench, "psbench [--depth D] [--fanout F] [--runs N]: benchmark the my_module traversals"},
+	{"builtins", list_builtins, "builtins [NAME]: list the builtins or show the help of one"},
+	{"load", load, "load [PATH]: add the builtins of a plugin, list the plugins without PATH"},
+	{"unload", unload, "unload NAME: remove a plugin loaded with load"},
+	{"time", time_command, "time COMMAND [ARGS]: run COMMAND and print its wall, cpu time, memory and context switches"},
+	{"stats", stats, "stats [NAME] [--reset]: latency of the commands run in this session"},
+	{"parallel", parallel, "parallel [-j N] [--keep-going] COMMAND [ARGS] [::: INPUT...]: run COMMAND for every input, {} is the input"},
+	{"trace", trace_command, "trace start|stop|dump FILE: record the command lifecycle as a Chrome trace"},
+	{"meminfo", meminfo, "meminfo [--trim]: live heap memory by subsystem and the totals of the allocator"},
+	{NULL, NULL, NULL},
+};
+
+// A shared object loaded with the load builtin
+struct plugin
 {
-	// Open .dir_history file in User directory and read all lines.
-	char *home = getenv("HOME");
-	char *history_file = malloc(strlen(home) + strlen(".dir_history") + 1);
-	strcpy(history_file, home);
-	strcat(history_file, "/.dir_history");
+	char *path;
+	void *handle;
+	const struct shellfyre_plugin *def;
+	struct builtin *builtins;
+	int count;
+	struct plugin *next;
+};
 
-	FILE *f = fopen(history_file, "r");
-	if (!f)
+struct plugin *plugins = NULL;
+
+// Open addressed table with a seed chosen so that no two builtins collide,
+// a lookup is one hash and one strcmp whatever the number of builtins.
+struct builtin **builtin_table = NULL;
+unsigned int builtin_mask = 0;
+unsigned int builtin_seed = 0;
+
+unsigned int builtin_hash(const char *name, unsigned int seed)
+{
+	unsigned int h = 2166136261u ^ seed; // FNV-1a
+	while (*name)
 	{
-		f = fopen(history_file, "w");
-		fclose(f);
-		f = fopen(history_file, "r");
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
 	}
+	return h ^ (h >> 15);
+}
 
-	// Read all lines and copy them to a new array.
-	char *lines[11];
-	int line_count = 0;
-	char line[1024];
-	while (fgets(line, sizeof(line), f))
+// Collect the builtins of the shell and the plugins, then search for a seed
+// that maps every one of them to its own slot
+void builtin_table_build()
+{
+	int count = 0, i;
+	struct plugin *p;
+	while (builtins[count].name)
+		count++;
+	for (p = plugins; p; p = p->next)
+		count += p->count;
+
+	free(builtin_list);
+	builtin_list = malloc(sizeof(struct builtin *) * count);
+	builtin_count = 0;
+	for (i = 0; builtins[i].name; ++i)
+		builtin_list[builtin_count++] = &builtins[i];
+	for (p = plugins; p; p = p->next)
+		for (i = 0; i < p->count; ++i)
+			builtin_list[builtin_count++] = &p->builtins[i];
+
+	unsigned int size = 16;
+	while (size < count * 4)
+		size *= 2;
+
+	while (1)
+	{
+		free(builtin_table);
+		builtin_table = malloc(sizeof(struct builtin *) * size);
+		builtin_mask = size - 1;
+		for (builtin_seed = 0; builtin_seed < 1000; ++builtin_seed)
+		{
+			memset(builtin_table, 0, sizeof(struct builtin *) * size);
+			for (i = 0; i < count; ++i)
+			{
+				unsigned int slot = builtin_hash(builtin_list[i]->name, builtin_seed) & builtin_mask;
+				if (builtin_table[slot])
+					break;
+				builtin_table[slot] = builtin_list[i];
+			}
+			if (i == count)
+				return;
+		}
+		size *= 2;
+	}
+}
+
+struct builtin *find_builtin(const char *name)
+{
+	if (!builtin_table)
+		builtin_table_build();
+	struct builtin *b = builtin_table[builtin_hash(name, builtin_seed) & builtin_mask];
+	return b && strcmp(b->name, name) == 0 ? b : NULL;
+}
+
+int list_builtins(struct command_t *command)
+{
+	if (command->arg_count > 0)
 	{
-		lines[line_count] = malloc(strlen(line) + 1);
-		strcpy(lines[line_count++], line);
+		struct builtin *b = find_builtin(command->args[0]);
+		if (b)
+			printf("%s\n", b->help);
+		else
+			printf("-%s: builtins: %s: not a builtin\n", sysname, command->args[0]);
+		return b ? SUCCESS : FAILURE;
 	}
-	fclose(f);
+	if (!builtin_list)
+		builtin_table_build();
+	for (int i = 0; i < builtin_count; ++i)
+		printf("%s\n", builtin_list[i]->help);
+	return SUCCESS;
+}
 
-	// Add the new path to the array.
-	lines[line_count] = malloc(strlen(path) + 1);
-	strcpy(lines[line_count++], path);
+// Handler of every plugin builtin, calls the plugin with an argv style array
+int run_plugin_builtin(struct command_t *command)
+{
+	struct builtin *b = find_builtin(command->name);
+	char **argv = malloc(sizeof(char *) * (command->arg_count + 2));
+	argv[0] = command->name;
+	for (int i = 0; i < command->arg_count; ++i)
+		argv[i + 1] = command->args[i];
+	argv[command->arg_count + 1] = NULL;
+
+	last_status = b->plugin_handler(command->arg_count + 1, argv);
+	fflush(stdout);
+	free(argv);
+	return SUCCESS;
+}
 
-	// Remove the oldest path if the array is full.
-	if (line_count > 10)
+// The builtins changed, rebuild the lookup table and the completions
+void builtins_changed()
+{
+	free(builtin_table);
+	builtin_table = NULL;
+	free(builtin_list);
+	builtin_list = NULL;
+	command_cache_invalidate();
+}
+
+// load PATH: dlopen a plugin described in shellfyre_plugin.h and register its builtins
+int load(struct command_t *command)
+{
+	struct plugin *p;
+	if (command->arg_count == 0)
 	{
-		free(lines[0]);
-		int i;
-		for (i = 1; i <= 10; ++i)
-			lines[i - 1] = lines[i];
-		line_count--;
+		for (p = plugins; p; p = p->next)
+			printf("%s (%s): %d builtins\n", p->def->name, p->path, p->count);
+		return SUCCESS;
 	}
 
-	// Write the new array to the file.
-	f = fopen(history_file, "w");
-	int i;
-	for (i = 0; i < line_count; ++i)
+	const char *path = command->args[0];
+	void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle)
+	{
+		printf("-%s: load: %s\n", sysname, dlerror());
+		return FAILURE;
+	}
+	for (p = plugins; p; p = p->next)
 	{
-		fprintf(f, "%s", lines[i]);
-		if (i == line_count - 1)
-			fprintf(f, "\n");
+		if (p->handle == handle)
+		{
+			printf("-%s: load: %s is already loaded\n", sysname, p->def->name);
+			dlclose(handle);
+			return FAILURE;
+		}
 	}
 
-	fclose(f);
+	const struct shellfyre_plugin *def = dlsym(handle, "shellfyre_plugin");
+	if (!def || def->abi_version != SHELLFYRE_PLUGIN_ABI_VERSION || !def->name || !def->builtins)
+	{
+		printf("-%s: load: %s: not a shellfyre plugin for ABI version %d\n", sysname, path,
+			   SHELLFYRE_PLUGIN_ABI_VERSION);
+		dlclose(handle);
+		return FAILURE;
+	}
+
+	int count = 0;
+	for (; def->builtins[count].name; ++count)
+	{
+		bool repeated = false; // two slots for one name would keep builtin_table_build searching forever
+		for (int i = 0; i < count && !repeated; ++i)
+			repeated = strcmp(def->builtins[i].name, def->builtins[count].name) == 0;
+		if (repeated || find_builtin(def->builtins[count].name) || !def->builtins[count].handler)
+		{
+			printf("-%s: load: %s: invalid or duplicate builtin %s\n", sysname, path, def->builtins[count].name);
+			dlclose(handle);
+			return FAILURE;
+		}
+	}
+	if (def->init && def->init() != 0)
+	{
+		printf("-%s: load: %s: initialization failed\n", sysname, path);
+		dlclose(handle);
+		return FAILURE;
+	}
+
+	p = calloc(1, sizeof(struct plugin));
+	p->path = strdup(path);
+	p->handle = handle;
+	p->def = def;
+	p->count = count;
+	p->builtins = calloc(count, sizeof(struct builtin));
+	for (int i = 0; i < count; ++i)
+	{
+		p->builtins[i].name = def->builtins[i].name;
+		p->builtins[i].help = def->builtins[i].help ? def->builtins[i].help : def->builtins[i].name;
+		p->builtins[i].handler = run_plugin_builtin;
+		p->builtins[i].plugin_handler = def->builtins[i].handler;
+	}
+	p->next = plugins;
+	plugins = p;
+	builtins_changed();
+	return SUCCESS;
 }
 
-// In this part, you will implement a command called take which takes 1 argument: the name
-// of the directory you want to create and change into. The command will create a directory
-// and change into it. The command must create the intermediate directories along the way if
-// they do not exist. For example: if you call take A/B/C, the command should create the
-// directories that do not exist and change into the last one (i.e, A/B/C).
-// Note: the idea for the command was adapted from the take command from zsh.
-int take(struct command_t *command)
+// unload NAME: remove a plugin by its name or the path it was loaded from
+int unload(struct command_t *command)
 {
+	if (command->arg_count == 0)
+	{
+		printf("Usage: unload NAME\n");
+		return FAILURE;
+	}
+	struct plugin **link, *p;
+	for (link = &plugins; (p = *link); link = &p->next)
+		if (strcmp(p->def->name, command->args[0]) == 0 || strcmp(p->path, command->args[0]) == 0)
+			break;
+	if (!p)
+	{
+		printf("-%s: unload: %s: no such plugin\n", sysname, command->args[0]);
+		return FAILURE;
+	}
+
+	*link = p->next;
+	builtins_changed();
+	if (p->def->fini)
+		p->def->fini();
+	dlclose(p->handle);
+	free(p->builtins);
+	free(p->path);
+	free(p);
+	return SUCCESS;
+}
 
-	// allocate memory for the args array
-	char **args = malloc(sizeof(char **) * (4));
-	args[0] = "mkdir";
-	args[1] = command->args[0];
-	args[2] = "-p";
-	args[3] = NULL;
+// Find the executable run for name the way execvp would, NULL if there is none
+char *resolve_command(const char *name)
+{
+	if (strchr(name, '/'))
+		return access(name, X_OK) == 0 ? strdup(name) : NULL;
 
-	pid_t pid = fork();
+	const char *path = getenv("PATH");
+	if (path == NULL)
+		path = "/usr/local/bin:/usr/bin:/bin";
+	char full[PATH_MAX];
+	struct stat st;
+	while (1)
+	{
+		const char *end = strchrnul(path, ':');
+		int len = end - path;
+		// an empty element is the working directory
+		if (snprintf(full, sizeof(full), "%.*s%s%s", len, path, len ? "/" : "", name) < sizeof(full) &&
+			access(full, X_OK) == 0 && stat(full, &st) == 0 && S_ISREG(st.st_mode))
+			return strdup(full);
+		if (*end == 0)
+			return NULL;
+		path = end + 1;
+	}
+}
+
+// Replace the process with the program at path, only returns on failure
+void exec_path(const char *path, struct command_t *command)
+{
+	char **argv = malloc(sizeof(char *) * (command->arg_count + 2));
+	argv[0] = command->name;
+	for (int i = 0; i < command->arg_count; ++i)
+		argv[i + 1] = command->args[i];
+	argv[command->arg_count + 1] = NULL;
+	execv(path, argv);
+	free(argv);
+}
+
+// Run command in a forked child and exit with its status: builtins are called
+// in the child, other commands replace it
+void exec_command(struct command_t *command)
+{
+	struct builtin *builtin = find_builtin(command->name);
+	if (builtin)
+	{
+		last_status = 0;
+		if (builtin->handler(command) == FAILURE && last_status == 0)
+			last_status = 1;
+		fflush(stdout);
+		_exit(last_status);
+	}
+	char *path = resolve_command(command->name);
+	if (path == NULL)
+	{
+		fprintf(stderr, "-%s: %s: command not found\n", sysname, command->name);
+		_exit(127);
+	}
+	exec_path(path, command);
+	fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+	_exit(126);
+}
+
+// Fork and exec a command that is not a builtin, usage receives what a foreground child used
+int run_external(struct command_t *command, struct rusage *usage)
+{
+	uint64_t t = trace_clock();
+	char *path = resolve_command(command->name);
+	trace_span("resolve", t, command->name);
+	if (path == NULL)
+	{
+		printf("-%s: %s: command not found\n", sysname, command->name);
+		last_status = 127;
+		return UNKNOWN;
+	}
+
+	// closed by a successful exec, carries errno otherwise
+	int exec_pipe[2];
+	if (pipe2(exec_pipe, O_CLOEXEC) == -1)
+	{
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+		free(path);
+		last_status = 126;
+		return UNKNOWN;
+	}
 
+	t = trace_clock();
+	pid_t pid = fork();
 	if (pid == 0) // child
-		execvp("mkdir", args);
+	{
+		close(exec_pipe[0]);
+		exec_path(path, command);
+		int err = errno;
+		write(exec_pipe[1], &err, sizeof(err));
+		_exit(126);
+	}
+	trace_span("fork", t, command->name);
+	close(exec_pipe[1]);
+	free(path);
+	if (pid == -1)
+	{
+		close(exec_pipe[0]);
+		printf("-%s: fork: %s\n", sysname, strerror(errno));
+		last_status = 126;
+		return UNKNOWN;
+	}
 
-	wait(NULL);
+	t = trace_clock();
+	int err;
+	ssize_t n;
+	while ((n = read(exec_pipe[0], &err, sizeof(err))) == -1 && errno == EINTR)
+		;
+	close(exec_pipe[0]);
+	trace_span("exec", t, command->name);
+	if (n == sizeof(err))
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(err));
 
-	strcpy(command->name, "cd");
-	process_command(command);
-	free(args);
+	t = trace_clock();
+	int status;
+	if (!command->background && wait4(pid, &status, 0, usage) == pid)
+		last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	trace_span("wait", t, command->name);
 	return SUCCESS;
 }
 
-// make a get request and save the response to a string
-int currency(struct command_t *command)
+int process_command(struct command_t *command)
 {
-	// popen("curl -s https://api.exchangeratesapi.io/latest?base=USD", "r");
-	char *response = malloc(sizeof(char) * 1024);
-	char *url = malloc(sizeof(char) * 1024);
-	strcpy(url, "curl -s -S \"https://free.currconv.com/api/v7/convert?q=");
-	strcat(url, command->args[0]);
-	strcat(url, "&compact=ultra&apiKey=d527543660bed7ba1595\"");
-	FILE *f = popen(url, "r");
-	fgets(response, 1024, f);
-	pclose(f);
-	char *printed = malloc(sizeof(char) * 1024);
-	strcpy(printed, "The current exchange rate for ");
-	strcat(printed, command->args[0]);
-	strcat(printed, " is ");
-	char *tkn = strtok(response, ":");
-	tkn = strtok(NULL, ":");
-	for (int i = 0; i < strlen(tkn); ++i)
+	if (strcmp(command->name, "") == 0)
+		return SUCCESS;
+
+	struct command_usage usage;
+	struct timespec start, end;
+	int code;
+	memset(&usage, 0, sizeof(usage));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	last_status = 0;
+	uint64_t t = trace_clock();
+	struct builtin *builtin = find_builtin(command->name);
+	if (builtin)
 	{
-		if (tkn[i] == '}')
+		struct rusage before;
+		getrusage(RUSAGE_SELF, &before);
+		code = builtin->handler(command);
+		if (code == FAILURE)
 		{
-			tkn[i] = '\0';
-			break;
+			// a builtin that set a status of its own keeps it
+			if (last_status == 0)
+				last_status = 1;
+			code = SUCCESS;
 		}
+		getrusage(RUSAGE_SELF, &usage.ru);
+		rusage_sub(&usage.ru, &before);
+		trace_span("builtin", t, command->name);
 	}
-	strcat(printed, tkn);
-	printf("%s\n", printed);
-	free(url);
-	free(response);
-	return SUCCESS;
+	else
+		code = run_external(command, &usage.ru);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	usage.wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (!command->background)
+	{
+		last_usage = usage;
+		stats_record(command->name, &usage);
+	}
+	return code;
 }
 
-// List files in the ./trash directory
-void list_trash()
+// One command of a parallel run
+struct parallel_job
 {
-	char *home = getenv("HOME");
-	char *trash_dir = malloc(strlen(home) + strlen("/.trash") + 1);
-	strcpy(trash_dir, home);
-	strcat(trash_dir, "/.trash");
-	DIR *dir = opendir(trash_dir);
-	struct dirent *entry;
-	while ((entry = readdir(dir)) != NULL)
+	struct command_t *command;
+	pid_t pid;
+	int pidfd;	// readable once the job exits, -1 on kernels without pidfd_open
+	int output; // memfd holding stdout and stderr of the job
+};
+
+// Copy of word with every {} replaced by arg
+char *parallel_substitute(const char *word, const char *arg, bool *used)
+{
+	size_t size = strlen(word) + 1, len = 0;
+	for (const char *p = strstr(word, "{}"); p; p = strstr(p + 2, "{}"))
+		size += strlen(arg);
+	char *out = malloc(size);
+	while (*word)
 	{
-		if (entry->d_name[0] != '.')
+		if (word[0] == '{' && word[1] == '}')
 		{
-			printf("%s\n", entry->d_name);
+			strcpy(out + len, arg);
+			len += strlen(arg);
+			word += 2;
+			*used = true;
 		}
+		else
+			out[len++] = *word++;
 	}
+	out[len] = 0;
+	return out;
+}
 
-	closedir(dir);
-	free(trash_dir);
+// The command for one input, arg is appended when the template has no {}
+struct command_t *parallel_command(char **words, int count, const char *arg)
+{
+	struct command_t *command = calloc(1, sizeof(struct command_t));
+	bool used = false;
+	command->name = parallel_substitute(words[0], arg, &used);
+	command->args = malloc(sizeof(char *) * (count + 1));
+	for (int i = 1; i < count; ++i)
+		command->args[command->arg_count++] = parallel_substitute(words[i], arg, &used);
+	if (!used)
+		command->args[command->arg_count++] = strdup(arg);
+	return command;
 }
 
-// Delete files in the ./trash directory
-void empty_trash()
+// Number of CPUs the shell may run on
+int available_cpus()
 {
-	char *home = getenv("HOME");
-	char *trash_dir = malloc(strlen(home) + strlen("/.trash") + 1);
-	strcpy(trash_dir, home);
-	strcat(trash_dir, "/.trash");
-	DIR *dir = opendir(trash_dir);
-	struct dirent *entry;
-	while ((entry = readdir(dir)) != NULL)
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		return CPU_COUNT(&set);
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+bool parallel_start(struct parallel_job *job)
+{
+	job->output = memfd_create("parallel", MFD_CLOEXEC);
+	if (job->output == -1)
 	{
-		if (entry->d_name[0] != '.')
-		{
-			char *file = malloc(strlen(trash_dir) + strlen(entry->d_name) + 1);
-			strcpy(file, trash_dir);
-			strcat(file, "/");
-			strcat(file, entry->d_name);
-			remove(file);
-			free(file);
-		}
+		printf("-%s: parallel: %s\n", sysname, strerror(errno));
+		return false;
 	}
-	closedir(dir);
-	free(trash_dir);
+	fflush(stdout);
+	job->pid = fork();
+	if (job->pid == 0)
+	{
+		dup2(job->output, STDOUT_FILENO);
+		dup2(job->output, STDERR_FILENO);
+		exec_command(job->command);
+	}
+	if (job->pid == -1)
+	{
+		printf("-%s: parallel: fork: %s\n", sysname, strerror(errno));
+		close(job->output);
+		return false;
+	}
+	job->pidfd = syscall(__NR_pidfd_open, job->pid, 0);
+	return true;
 }
 
-// Restore a file from the ./trash directory
-// First list all files with index, then ask user to select one
-// Then restore the file to the current directory
-void restore_from_trash()
+/**
+ * Wait for one of the running jobs and reap it, other children of the shell
+ * such as background commands are left alone
+ * @param  status receives the wait status of the job
+ * @return        slot of the job, -1 on error
+ */
+int parallel_wait(struct parallel_job *jobs, int slots, struct pollfd *fds, int *status)
 {
-	char *home = getenv("HOME");
-	char *trash_dir = malloc(strlen(home) + strlen("/.trash") + 1);
-	strcpy(trash_dir, home);
-	strcat(trash_dir, "/.trash");
-	DIR *dir = opendir(trash_dir);
-	struct dirent *entry;
-	int index = 0;
-	char *files[100];
-	while ((entry = readdir(dir)) != NULL)
+	int n = 0, slot = -1, i;
+	for (i = 0; i < slots; ++i)
 	{
-		if (entry->d_name[0] != '.')
+		if (!jobs[i].command)
+			continue;
+		if (jobs[i].pidfd < 0)
 		{
-			files[index] = malloc(strlen(entry->d_name) + 1);
-			strcpy(files[index++], entry->d_name);
+			slot = i; // no pidfd to poll, wait for this job
+			break;
 		}
+		fds[n++] = (struct pollfd){.fd = jobs[i].pidfd, .events = POLLIN};
 	}
-	closedir(dir);
-	for (int i = 0; i < index; ++i)
+	if (slot == -1 && n > 0)
+	{
+		while (poll(fds, n, -1) == -1)
+			if (errno != EINTR)
+				return -1;
+		for (i = 0; !fds[i].revents; ++i)
+			;
+		for (slot = 0; !jobs[slot].command || jobs[slot].pidfd != fds[i].fd; ++slot)
+			;
+	}
+	if (slot == -1)
+		return -1;
+	pid_t pid;
+	while ((pid = waitpid(jobs[slot].pid, status, 0)) == -1 && errno == EINTR)
+		;
+	if (jobs[slot].pidfd >= 0)
+		close(jobs[slot].pidfd);
+	return pid == -1 ? -1 : slot;
+}
+
+// Write what the job printed in one piece
+void parallel_flush(struct parallel_job *job)
+{
+	char buf[65536];
+	off_t offset = 0;
+	ssize_t n;
+	fflush(stdout);
+	while ((n = pread(job->output, buf, sizeof(buf), offset)) > 0)
+	{
+		write(STDOUT_FILENO, buf, n);
+		offset += n;
+	}
+	close(job->output);
+}
+
+// parallel [-j N] [--keep-going] COMMAND [ARGS] [::: INPUT...]
+// Runs COMMAND once for every INPUT, or for every line of stdin without :::,
+// with up to N jobs at a time. {} in COMMAND and ARGS is replaced by the input,
+// which is appended when there is no {}. The output of every job is printed in
+// one piece when it finishes. After a failure no new jobs are started unless
+// --keep-going is given. The exit status is the number of failed jobs.
+int parallel(struct command_t *command)
+{
+	int slots = available_cpus(), i = 0;
+	bool keep_going = false;
+	for (; i < command->arg_count && command->args[i][0] == '-'; ++i)
+	{
+		if (strcmp(command->args[i], "-j") == 0 && i + 1 < command->arg_count)
+			slots = atoi(command->args[++i]);
+		else if (strncmp(command->args[i], "-j", 2) == 0)
+			slots = atoi(command->args[i] + 2);
+		else if (strcmp(command->args[i], "--keep-going") == 0)
+			keep_going = true;
+		else
+			break;
+	}
+	int words = i, word_count = 0;
+	while (words + word_count < command->arg_count && strcmp(command->args[words + word_count], ":::") != 0)
+		word_count++;
+	if (word_count == 0 || slots < 1 || command->args[words][0] == '-') // no command, or an unknown option
+	{
+		printf("Usage: parallel [-j N] [--keep-going] COMMAND [ARGS] [::: INPUT...]\n");
+		return FAILURE;
+	}
+
+	// the inputs, from the command line or from stdin
+	char **inputs = NULL;
+	int input_count = 0;
+	if (words + word_count < command->arg_count)
 	{
-		printf("%d. %s\n", i + 1, files[i]);
+		input_count = command->arg_count - words - word_count - 1;
+		inputs = malloc(sizeof(char *) * (input_count + 1));
+		for (i = 0; i < input_count; ++i)
+			inputs[i] = strdup(command->args[words + word_count + 1 + i]);
+	}
+	else
+	{
+		char *line = NULL;
+		size_t size = 0;
+		ssize_t len;
+		int capacity = 0;
+		while ((len = getline(&line, &size, stdin)) != -1)
+		{
+			if (len > 0 && line[len - 1] == '\n')
+				line[--len] = 0;
+			if (len == 0)
+				continue;
+			if (input_count == capacity)
+			{
+				capacity = capacity ? capacity * 2 : 64;
+				inputs = realloc(inputs, sizeof(char *) * capacity);
+			}
+			inputs[input_count++] = strdup(line);
+		}
+		free(line);
+		clearerr(stdin);
 	}
-	int choice = 0;
-	printf("Enter the index of the file you want to restore: ");
-	scanf("%d", &choice);
-	if (choice > 0 && choice <= index)
+
+	struct parallel_job *jobs = calloc(slots, sizeof(struct parallel_job));
+	struct pollfd *fds = malloc(sizeof(struct pollfd) * slots);
+	int next = 0, running = 0, failed = 0;
+	while (running > 0 || (next < input_count && (failed == 0 || keep_going)))
 	{
-		char *file = malloc(strlen(trash_dir) + strlen(files[choice - 1]) + 2);
-		strcpy(file, trash_dir);
-		strcat(file, "/");
-		strcat(file, files[choice - 1]);
-		char *dest = malloc(strlen("./") + strlen(files[choice - 1]) + 1);
-		strcpy(dest, "./");
-		strcat(dest, files[choice - 1]);
-		char *move_command = malloc(strlen("mv ") + strlen(file) + strlen(dest) + 1);
-		strcpy(move_command, "mv ");
-		strcat(move_command, file);
-		strcat(move_command, " ");
-		strcat(move_command, dest);
-		printf("%s\n", move_command);
-		system(move_command);
-		free(file);
-		free(dest);
-		free(move_command);
+		// fill the free slots
+		for (i = 0; i < slots && next < input_count && (failed == 0 || keep_going); ++i)
+		{
+			if (jobs[i].command)
+				continue;
+			jobs[i].command = parallel_command(command->args + words, word_count, inputs[next++]);
+			if (parallel_start(&jobs[i]))
+				running++;
+			else
+			{
+				free_command(jobs[i].command);
+				jobs[i].command = NULL;
+				failed++;
+			}
+		}
+		if (running == 0)
+			break;
+
+		int status;
+		i = parallel_wait(jobs, slots, fds, &status);
+		if (i == -1)
+			break;
+		parallel_flush(&jobs[i]);
+		free_command(jobs[i].command);
+		jobs[i].command = NULL;
+		running--;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
 	}
-	for (int i = 0; i < index; ++i)
+
+	for (i = 0; i < input_count; ++i)
+		free(inputs[i]);
+	free(inputs);
+	free(jobs);
+	free(fds);
+	last_status = failed > 101 ? 101 : failed;
+	return SUCCESS;
+}
+
+// Memory accounting. The long lived structures of every subsystem are walked
+// and their blocks measured with malloc_usable_size, so nothing has to be
+// tracked on the allocation paths. What the walk does not find shows up as the
+// difference with the heap in use reported by the allocator.
+
+struct mem_usage
+{
+	const char *name;
+	long blocks;
+	size_t bytes;
+};
+
+void mem_count(struct mem_usage *u, void *p)
+{
+	if (!p)
+		return;
+	u->blocks++;
+	u->bytes += malloc_usable_size(p);
+}
+
+void mem_count_trie(struct mem_usage *u, struct trie_node *node)
+{
+	for (; node; node = node->next)
 	{
-		free(files[i]);
+		mem_count(u, node);
+		mem_count_trie(u, node->child);
 	}
-	free(trash_dir);
 }
 
-// Delete a file from the ./trash directory
-// First list all files with index, then ask user to select one
-// Then delete the file from ./trash directory
-void delete_from_trash()
+enum
 {
-	char *home = getenv("HOME");
-	char *trash_dir = malloc(strlen(home) + strlen("/.trash") + 1);
-	strcpy(trash_dir, home);
-	strcat(trash_dir, "/.trash");
-	DIR *dir = opendir(trash_dir);
-	struct dirent *entry;
-	int index = 0;
-	char *files[100];
-	while ((entry = readdir(dir)) != NULL)
-	{
-		if (entry->d_name[0] != '.')
-		{
-			files[index] = malloc(strlen(entry->d_name) + 1);
-			strcpy(files[index++], entry->d_name);
-		}
-	}
-	closedir(dir);
-	for (int i = 0; i < index; ++i)
-	{
-		printf("%d. %s\n", i + 1, files[i]);
-	}
-	int choice = 0;
-	printf("Enter the index of the file you want to delete: ");
-	scanf("%d", &choice);
-	if (choice > 0 && choice <= index)
+	MEM_HISTORY,
+	MEM_COMPLETION,
+	MEM_BUILTINS,
+	MEM_STATS,
+	MEM_GLOB,
+	MEM_IGNORE,
+	MEM_TRACE,
+	MEM_SUBSYSTEMS,
+};
+
+// Fill usage with the live blocks of every subsystem
+void mem_collect(struct mem_usage usage[MEM_SUBSYSTEMS])
+{
+	const char *names[MEM_SUBSYSTEMS] = {"history", "completion", "builtins", "stats", "glob cache", "ignore cache", "trace"};
+	for (int i = 0; i < MEM_SUBSYSTEMS; ++i)
+		usage[i] = (struct mem_usage){.name = names[i]};
+
+	for (int i = 0; i < history_count; ++i)
+		mem_count(&usage[MEM_HISTORY], history[i]);
+
+	struct mem_usage *u = &usage[MEM_COMPLETION];
+	mem_count_trie(u, command_cache.trie);
+	mem_count(u, command_cache.path);
+	mem_count(u, command_cache.mtimes);
+	for (struct dir_listing *l = dir_cache; l; l = l->next)
 	{
-		char *file = malloc(strlen(trash_dir) + strlen(files[choice - 1]) + 1);
-		strcpy(file, trash_dir);
-		strcat(file, "/");
-		strcat(file, files[choice - 1]);
-		char *remove_command = malloc(strlen("rm ") + strlen(file) + 1);
-		strcpy(remove_command, "rm ");
-		strcat(remove_command, file);
-		system(remove_command);
-		free(file);
+		mem_count(u, l);
+		mem_count(u, l->path);
+		for (int i = 0; i < l->count; ++i)
+			mem_count(u, l->names[i]);
+		mem_count(u, l->names);
+		mem_count(u, l->is_dir);
 	}
-	for (int i = 0; i < index; ++i)
+
+	u = &usage[MEM_BUILTINS];
+	mem_count(u, builtin_list);
+	mem_count(u, builtin_table);
+	for (struct plugin *p = plugins; p; p = p->next)
 	{
-		free(files[i]);
+		mem_count(u, p);
+		mem_count(u, p->path);
+		mem_count(u, p->builtins);
 	}
-	free(trash_dir);
-}
 
-// Move a file to the ./trash directory
-void move_to_trash(char *file_name)
-{
-	// Check the ./trash directory exists
-	char *home = getenv("HOME");
-	char *trash_dir = malloc(strlen(home) + strlen("/.trash") + 1);
-	strcpy(trash_dir, home);
-	strcat(trash_dir, "/.trash");
-	DIR *dir = opendir(trash_dir);
-	if (dir == NULL)
+	for (struct command_stats *s = stats_list; s; s = s->next)
 	{
-		mkdir(trash_dir, 0777);
+		mem_count(&usage[MEM_STATS], s);
+		mem_count(&usage[MEM_STATS], s->name);
 	}
-	else
+
+	for (struct glob_listing *g = glob_cache; g; g = g->next)
 	{
-		closedir(dir);
+		mem_count(&usage[MEM_GLOB], g);
+		mem_count(&usage[MEM_GLOB], g->path);
+		for (int i = 0; i < g->count; ++i)
+			mem_count(&usage[MEM_GLOB], g->names[i]);
+		mem_count(&usage[MEM_GLOB], g->names);
+		mem_count(&usage[MEM_GLOB], g->is_dir);
 	}
 
-	// Check the file exists
-	if (access(file_name, F_OK) != -1)
+	for (int b = 0; b < IGNORE_CACHE_BUCKETS; ++b)
 	{
-		char *move_command = malloc(strlen(file_name) + strlen(trash_dir) + strlen("mv ") + 1);
-		strcpy(move_command, "mv ");
-		strcat(move_command, file_name);
-		strcat(move_command, " ");
-		strcat(move_command, trash_dir);
-		system(move_command);
-		free(move_command);
+		for (struct ignore_list *l = ignore_cache[b]; l; l = l->next)
+		{
+			mem_count(&usage[MEM_IGNORE], l);
+			for (int i = 0; i < l->count; ++i)
+				mem_count(&usage[MEM_IGNORE], l->rules[i].pattern);
+			mem_count(&usage[MEM_IGNORE], l->rules);
+		}
 	}
-	free(trash_dir);
+
+	mem_count(&usage[MEM_TRACE], trace.events);
 }
 
-// Trash command
-int trash(struct command_t *command)
+// Resident set size of the shell in bytes
+size_t mem_rss()
 {
-	if (command->arg_count == 0)
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f)
 	{
-		printf("Usage: trash [OPTION]... [FILE]...\n");
-		printf("Try 'trash --help' for more information.\n");
-		return SUCCESS;
+		if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
 	}
-	printf("%s\n", command->args[0]);
-	if (strcmp(command->args[0], "--help") == 0)
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Usage: meminfo [--trim]
+// Live heap blocks of every subsystem, then the totals of the allocator.
+// --trim first returns the free memory at the top of the heap to the system.
+int meminfo(struct command_t *command)
+{
+	if (command->arg_count > 0 && strcmp(command->args[0], "--trim") == 0)
+		malloc_trim(0);
+	else if (command->arg_count > 0)
 	{
-		printf("Usage: trash [OPTION]... [FILE]...\n");
-		printf("Move files to the trash.\n");
-		printf("\n");
-		printf("  --help     display this help and exit\n");
-		printf("  --restore  restore a file from trash\n");
-		printf("  --delete   delete a file from trash\n");
-		printf("  --move     move a file to trash\n");
-		printf("\n");
-		return SUCCESS;
+		printf("Usage: meminfo [--trim]\n");
+		return FAILURE;
 	}
-	else if (strcmp(command->args[0], "--list") == 0)
+
+	struct mem_usage usage[MEM_SUBSYSTEMS];
+	mem_collect(usage);
+	long blocks = 0;
+	size_t bytes = 0;
+	printf("%-14s %10s %12s\n", "subsystem", "blocks", "bytes");
+	for (int i = 0; i < MEM_SUBSYSTEMS; ++i)
 	{
-		// List all files in the trash
-		list_trash();
-		return SUCCESS;
+		printf("%-14s %10ld %12zu\n", usage[i].name, usage[i].blocks, usage[i].bytes);
+		blocks += usage[i].blocks;
+		bytes += usage[i].bytes;
 	}
-	else if (strcmp(command->args[0], "--empty") == 0)
+	printf("%-14s %10ld %12zu\n", "total", blocks, bytes);
+
+	struct mallinfo2 mi = mallinfo2();
+	printf("\n%-25s %12zu\n", "heap in use", mi.uordblks + mi.hblkhd);
+	printf("%-25s %12zu\n", "heap not accounted above", mi.uordblks + mi.hblkhd > bytes ? mi.uordblks + mi.hblkhd - bytes : 0);
+	printf("%-25s %12zu\n", "heap free", mi.fordblks);
+	printf("%-25s %12zu\n", "mmapped", mi.hblkhd);
+	printf("%-25s %12zu\n", "rss", mem_rss());
+	return SUCCESS;
+}
+
+// Benchmark mode, "shellfyre --bench [SCALE]". Every result is printed as one
+// JSON object per line so runs can be compared by scripts.
+
+int bench_out = -1; // the real stdout while the commands write to /dev/null
+
+// Send the output of the benchmarked commands to /dev/null, or back
+void bench_quiet(bool quiet)
+{
+	static int saved = -1;
+	fflush(stdout);
+	if (quiet)
 	{
-		// Empty the trash
-		empty_trash();
-		return SUCCESS;
+		saved = dup(STDOUT_FILENO);
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		close(null);
 	}
-	else if (strcmp(command->args[0], "--restore") == 0)
+	else if (saved >= 0)
 	{
-		// Restore a file from the trash
-		restore_from_trash();
-		return SUCCESS;
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+		saved = -1;
 	}
-	else if (strcmp(command->args[0], "--delete") == 0)
+}
+
+void bench_report(const char *name, long iterations, double seconds, const char *extra)
+{
+	dprintf(bench_out, "{\"bench\":\"%s\",\"iterations\":%ld,\"seconds\":%.6f,\"ops_per_sec\":%.1f%s%s}\n", name,
+			iterations, seconds, iterations / seconds, extra ? "," : "", extra ? extra : "");
+}
+
+// Parse and run line iterations times, the way the prompt loop does
+double bench_commands(const char *line, long iterations)
+{
+	char buf[LINE_SIZE];
+	uint64_t start = monotonic_ns();
+	for (long i = 0; i < iterations; ++i)
 	{
-		// Remove a file from the trash
-		delete_from_trash();
-		return SUCCESS;
+		struct command_t *command = calloc(1, sizeof(struct command_t));
+		snprintf(buf, sizeof(buf), "%s", line);
+		parse_command(buf, command);
+		process_command(command);
+		free_command(command);
 	}
-	else if (strcmp(command->args[0], "--move") == 0)
+	return (monotonic_ns() - start) / 1e9;
+}
+
+// Create a tree of directories with files to search in
+long bench_make_tree(const char *dir, int depth, int fanout, int files)
+{
+	char path[PATH_MAX];
+	long entries = 0;
+	for (int i = 0; i < files; ++i)
 	{
-		// Restore a file from the trash
-		move_to_trash(command->args[1]);
-		return SUCCESS;
+		snprintf(path, sizeof(path), "%s/file_%d.txt", dir, i);
+		close(open(path, O_WRONLY | O_CREAT, 0644));
+		entries++;
 	}
-	else
+	if (depth == 0)
+		return entries;
+	for (int i = 0; i < fanout; ++i)
 	{
-		printf("Usage: trash [OPTION]... [FILE]...\n");
-		printf("Try 'trash --help' for more information.\n");
-		return SUCCESS;
+		snprintf(path, sizeof(path), "%s/dir_%d", dir, i);
+		mkdir(path, 0755);
+		entries += 1 + bench_make_tree(path, depth - 1, fanout, files);
 	}
+	return entries;
 }
 
-// Fetch joke from https://icanhazdadjoke.com using curl and notifiy the user using notify-send every 15 minutes using crontab
-int joker(struct command_t *command)
+int bench_remove(const char *path, const struct stat *st, int flag, struct FTW *ftw)
 {
+	return remove(path);
+}
 
-	// No args means wrong input
-	if (command->args[0] == NULL)
-	{
-		printf("Invalid input\n");
-		printf("Usage: joker start/stop\n");
-		return SUCCESS;
-	}
-
-	// If it is a valid command, clean the crontab
-	if (strcmp(command->args[0], "stop") == 0 || strcmp(command->args[0], "start") == 0)
+int run_bench(double scale)
+{
+	char root[] = "/tmp/shellfyre-bench-XXXXXX";
+	if (!mkdtemp(root))
 	{
-		system("crontab -l > crontab");
-		FILE *f = fopen("crontab", "w");
-		fprintf(f, " ");
-		fclose(f);
-		system("crontab crontab");
+		perror("mkdtemp");
+		return 1;
 	}
+	char cwd[PATH_MAX], extra[128];
+	getcwd(cwd, sizeof(cwd));
+	setenv("HOME", root, 1); // keep cd and cdh away from the real ~/.dir_history
+	chdir(root);
+	bench_out = dup(STDOUT_FILENO);
 
-	if (strcmp(command->args[0], "start") == 0)
-	{
-		int every_x_minutes = 15;
-		// If the user specified a valid frequency, use that instead
-		if (command->args[1] != NULL)
-			every_x_minutes = atoi(command->args[1]) ? atoi(command->args[1]) : 15;
-
-		printf("%s", command->args[1]);
-		// Create joker.sh file in User directory
-		char *home = getenv("HOME");
-		char *joker_file = malloc(strlen(home) + strlen("/joker.sh") + 1);
-		strcpy(joker_file, home);
-		strcat(joker_file, "/joker.sh");
+	long n = 20000 * scale;
+	bench_quiet(true);
+	double seconds = bench_commands("builtins", n);
+	bench_quiet(false);
+	bench_report("builtin_command", n, seconds, NULL);
 
-		// Write fetch and notify-send commands to joker.sh
-		FILE *f = fopen(joker_file, "w");
-		fprintf(f, "#!/bin/bash\n");
-		fprintf(f, "IP_MSG=\"$(/usr/bin/curl -s https://icanhazdadjoke.com 2>&1)\"\n");
-		fprintf(f, "STATUS=$?\n\n");
-		fprintf(f, "ICON=\"face-laugh\"\n\n");
-		fprintf(f, "if [ $STATUS -ne 0 ]; then\n");
-		fprintf(f, "    MESSAGE=\"Error Occurred! [ $IP_MSG ]\"\n");
-		fprintf(f, "    ICON=\"dialog-error\"\n");
-		fprintf(f, "else\n");
-		fprintf(f, "    MESSAGE=\"$IP_MSG\"\n");
-		fprintf(f, "fi\n\n");
-		fprintf(f, "XDG_RUNTIME_DIR=/run/user/$(id -u) notify-send -t 4000 -i \"$ICON\" \"Ha ha ha\" \"$MESSAGE\"\n");
-		fclose(f);
+	n = 1000 * scale;
+	bench_quiet(true);
+	seconds = bench_commands("true", n);
+	bench_quiet(false);
+	bench_report("external_command", n, seconds, NULL);
 
-		// Make joker.sh executable
-		chmod(joker_file, S_IRWXU);
+	// parse only, a line with quotes, redirections and a pipe but no globs
+	const char *line = "grep -n \"some pattern\" input.txt 'second file' > out.txt | sort -r -k 2 | uniq -c";
+	n = 200000 * scale;
+	char buf[LINE_SIZE];
+	uint64_t start = monotonic_ns();
+	for (long i = 0; i < n; ++i)
+	{
+		struct command_t *command = calloc(1, sizeof(struct command_t));
+		snprintf(buf, sizeof(buf), "%s", line);
+		parse_command(buf, command);
+		free_command(command);
+	}
+	seconds = (monotonic_ns() - start) / 1e9;
+	snprintf(extra, sizeof(extra), "\"mb_per_sec\":%.2f", n * strlen(line) / seconds / 1e6);
+	bench_report("parse", n, seconds, extra);
 
-		// Create crontab file in User directory
-		char *crontab_file = malloc(strlen(home) + strlen("/crontab") + 1);
-		strcpy(crontab_file, home);
-		strcat(crontab_file, "/crontab");
+	mkdir("tree", 0755);
+	long entries = bench_make_tree("tree", 3, 6, 10);
+	chdir("tree");
+	n = 50 * scale;
+	bench_quiet(true);
+	seconds = bench_commands("filesearch -r file_7", n);
+	bench_quiet(false);
+	snprintf(extra, sizeof(extra), "\"entries\":%ld,\"entries_per_sec\":%.0f", entries, entries * n / seconds);
+	bench_report("filesearch_recursive", n, seconds, extra);
 
-		f = fopen(crontab_file, "w");
-		fprintf(f, "* * * * * %s\n", joker_file);
-		fclose(f);
+	n = 2000 * scale;
+	bench_quiet(true);
+	seconds = 0;
+	for (long i = 0; i < n / 2; ++i)
+		seconds += bench_commands("cd dir_0", 1) + bench_commands("cd ..", 1);
+	bench_quiet(false);
+	bench_report("cd", n / 2 * 2, seconds, NULL);
 
-		// Add joker.sh to crontab
-		system("crontab -l > crontab");
-		f = fopen("crontab", "a");
-		fprintf(f, "*/%d * * * * %s\n", every_x_minutes, joker_file);
-		fclose(f);
-		system("crontab crontab");
-		free(crontab_file);
-		free(joker_file);
+	// cdh reads its choice from stdin, always pick the newest entry
+	n = 500 * scale;
+	int input[2], saved_stdin = dup(STDIN_FILENO);
+	pid_t feeder = -1;
+	if (n > 0 && pipe(input) == 0)
+	{
+		feeder = fork();
+		if (feeder == 0)
+		{
+			close(input[0]);
+			for (long i = 0; i < n; ++i)
+				write(input[1], "1\n", 2);
+			_exit(0);
+		}
+		close(input[1]);
+		if (feeder == -1)
+			close(input[0]);
 	}
-	else
+	if (feeder > 0)
 	{
-		// Other args are invalid
-		printf("Invalid input\n");
-		printf("Usage: joker start/stop\n");
-		return SUCCESS;
+		dup2(input[0], STDIN_FILENO);
+		close(input[0]);
+		bench_quiet(true);
+		seconds = bench_commands("cdh", n);
+		bench_quiet(false);
+		waitpid(feeder, NULL, 0);
+		dup2(saved_stdin, STDIN_FILENO);
+		bench_report("cdh", n, seconds, NULL);
 	}
+	close(saved_stdin);
 
-	return SUCCESS;
+	chdir(cwd);
+	nftw(root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+	close(bench_out);
+	return 0;
 }
 
-// When the command is called for the first time, shellfyre will prompt sudo password
-// to load the module into the kernel. After the module is loaded by the first call,
-// the tree traversal operation on the targeted PID will run. Successive calls to the
-// command will not load the module again. They will only invoke tree traversal
-// operations by on targeted PIDs. In the first call of the command, the traversal
-// operation can be run by the initialization function of the kernel module. In the
-// following calls, you can use ioctl function calls to trigger the operations.
-// shellfyre should remove the module from kernel when the shell is exited.
-int pstraverse(struct command_t *command)
+// Soak mode, "shellfyre --soak [COMMANDS]". Runs a mix of commands through the
+// same parsing and execution path as the prompt and fails when the heap or the
+// resident set keeps growing once the caches are warm.
+
+#define SOAK_HEAP_SLACK (1 << 20) // bytes the heap in use may grow after the warm up
+#define SOAK_RSS_SLACK (4 << 20)
+
+int run_soak(long commands)
 {
-	if (command->args[0] == NULL)
+	char root[] = "/tmp/shellfyre-soak-XXXXXX";
+	if (!mkdtemp(root))
 	{
-		printf("Invalid input\n");
-		return SUCCESS;
+		perror("mkdtemp");
+		return 1;
 	}
+	char cwd[PATH_MAX];
+	getcwd(cwd, sizeof(cwd));
+	setenv("HOME", root, 1);
+	chdir(root);
+	bench_out = dup(STDOUT_FILENO);
+
+	mkdir("tree", 0755);
+	bench_make_tree("tree", 2, 3, 4);
+	chdir("tree");
+	close(open("junk", O_WRONLY | O_CREAT, 0644));
 
-	int pid = atoi(command->args[0]);
-	if (pid == 0)
+	// cdh and trash --restore read their choice from stdin, always pick the first entry
+	int input[2], saved_stdin = dup(STDIN_FILENO);
+	pid_t feeder = -1;
+	if (pipe(input) == -1 || (feeder = fork()) == -1)
 	{
-		printf("Invalid input\n");
-		return SUCCESS;
+		perror("soak");
+		chdir(cwd);
+		nftw(root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+		return 1;
 	}
-
-	// If the module is not loaded, load it
-	if (moduleInstalled == 0)
+	if (feeder == 0)
 	{
-		system("sudo insmod my_module.ko");
-		moduleInstalled = 1;
+		close(input[0]);
+		char ones[4096];
+		for (int i = 0; i < sizeof(ones); i += 2)
+			memcpy(ones + i, "1\n", 2);
+		while (write(input[1], ones, sizeof(ones)) > 0)
+			;
+		_exit(0);
 	}
+	close(input[1]);
+	dup2(input[0], STDIN_FILENO);
+	close(input[0]);
 
-	// If the module is loaded, initialize the traversal operation
-	if (moduleInstalled == 1)
+	const char *lines[] = {
+		"builtins",
+		"cd dir_0 && cd ..",
+		"filesearch -r file_3",
+		"stats",
+		"take made/a/b && cd ../../..",
+		"cdh",
+		"trash --move junk ; trash --restore",
+		"(builtins cd) || nosuchcommand ; stats file_*",
+		"meminfo",
+		"time builtins",
+	};
+	int line_count = sizeof(lines) / sizeof(lines[0]);
+	long warm_up = commands / 10 < 10000 ? commands / 10 : 10000;
+	size_t heap_start = 0, rss_start = 0, rss_max = 0;
+	char line[LINE_SIZE];
+
+	bench_quiet(true);
+	int saved_stderr = dup(STDERR_FILENO); // time reports on stderr
+	dup2(STDOUT_FILENO, STDERR_FILENO);
+	uint64_t start = monotonic_ns();
+	for (long i = 0; i < commands; ++i)
 	{
-		int fd = open("/dev/my_device", O_RDWR);
-		if (fd < 0)
-		{
-			printf("Error opening device file\n");
-			return SUCCESS;
-		}
-		// look at the second argument to check if its -b or -d
-		// if -b, then initialize the traversal operation with bfs
-		// if -d, then initialize the traversal operation with dfs
-		if (command->args[1] != NULL && strcmp(command->args[1], "-b") == 0)
+		if (i == warm_up)
 		{
-			ioctl(fd, PS_BFS, &pid);
+			heap_start = mallinfo2().uordblks + mallinfo2().hblkhd;
+			rss_start = mem_rss();
 		}
-		else if (command->args[1] != NULL && strcmp(command->args[1], "-d") == 0)
+		// an external command now and then, they cost a fork each
+		snprintf(line, sizeof(line), "%s", i % 100 == 99 ? "true" : lines[i % line_count]);
+		add_to_history(line);
+		struct list_node *list = parse_command_line(line);
+		if (list)
 		{
-			ioctl(fd, PS_DFS, &pid);
+			run_list(list);
+			free_list(list);
 		}
-		close(fd);
+		generation++;
+		if (i % 1000 == 0 && mem_rss() > rss_max)
+			rss_max = mem_rss();
 	}
+	double seconds = (monotonic_ns() - start) / 1e9;
+	dup2(saved_stderr, STDERR_FILENO);
+	close(saved_stderr);
+	bench_quiet(false);
 
-	return SUCCESS;
+	kill(feeder, SIGTERM);
+	waitpid(feeder, NULL, 0);
+	dup2(saved_stdin, STDIN_FILENO);
+	close(saved_stdin);
+
+	size_t heap_end = mallinfo2().uordblks + mallinfo2().hblkhd, rss_end = mem_rss();
+	bool ok = heap_end <= heap_start + SOAK_HEAP_SLACK && rss_end <= rss_start + SOAK_RSS_SLACK;
+	dprintf(bench_out,
+			"{\"soak\":%ld,\"seconds\":%.3f,\"heap_start\":%zu,\"heap_end\":%zu,\"rss_start\":%zu,\"rss_end\":%zu,"
+			"\"rss_max\":%zu,\"ok\":%s}\n",
+			commands, seconds, heap_start, heap_end, rss_start, rss_end, rss_max, ok ? "true" : "false");
+
+	chdir(cwd);
+	nftw(root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+	close(bench_out);
+	return ok ? 0 : 1;
 }
 
-int process_command(struct command_t *command)
+// Server mode. "shellfyre --serve SOCK" keeps a warm shell that runs the lines
+// sent by "shellfyre --connect SOCK -c LINE". The client passes its stdin,
+// stdout and stderr with SCM_RIGHTS, so output goes straight to the client's
+// terminal or pipes, and only the exit status comes back over the socket.
+
+#define SERVE_VERSION 1
+
+struct serve_request
 {
-	int r;
-	if (strcmp(command->name, "") == 0)
-		return SUCCESS;
+	uint32_t version;
+	uint32_t cwd_len;  // bytes of the working directory that follow
+	uint32_t line_len; // bytes of the command line that follow the directory
+};
 
-	if (strcmp(command->name, "exit") == 0)
+// Read exactly size bytes, false on EOF or error
+bool read_full(int fd, void *buf, size_t size)
+{
+	while (size > 0)
 	{
-		system("sudo rmmod my_module");
-		moduleInstalled = 0;
-		return EXIT;
+		ssize_t n = read(fd, buf, size);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf = (char *)buf + n;
+		size -= n;
 	}
+	return true;
+}
 
-	if (strcmp(command->name, "cd") == 0)
+int serve_address(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
 	{
-		if (command->arg_count > 0)
-		{
-			r = chdir(command->args[0]);
-			if (r == -1)
-				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-			else
-				// for the cdh command
-				add_directory_to_history(getcwd(NULL, 0));
-			return SUCCESS;
-		}
+		fprintf(stderr, "-%s: %s: socket path too long\n", sysname, path);
+		return -1;
 	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
 
-	if (strcmp(command->name, "filesearch") == 0)
-	{
-		return filesearch(command, ".");
-	}
+atomic_bool serve_done; // the status of the request is on its way
 
-	if (strcmp(command->name, "cdh") == 0)
-	{
-		return cdh(command);
-	}
+// The commands of a request get the signals the client forwards, the request
+// survives them and only skips what is left of its line
+void serve_signal(int sig)
+{
+	list_interrupted = 1;
+}
 
-	if (strcmp(command->name, "take") == 0)
-	{
-		return take(command);
-	}
+// Watch the connection of a request while it runs: a signal number sent by the
+// client goes to the process group of the request, and a client that goes away
+// before the status was sent hangs the commands up
+void *serve_watch(void *arg)
+{
+	int conn = (intptr_t)arg;
+	unsigned char sig;
+	ssize_t n;
+	while ((n = read(conn, &sig, 1)) == 1 || (n == -1 && errno == EINTR))
+		if (n == 1 && (sig == SIGINT || sig == SIGQUIT || sig == SIGTERM))
+			kill(0, sig);
+	if (!atomic_load(&serve_done))
+		kill(0, SIGHUP);
+	return NULL;
+}
 
-	if (strcmp(command->name, "currency") == 0)
-	{
-		return currency(command);
-	}
+// Run one request in a child of the server, the connection is closed by exit
+void serve_request(int conn)
+{
+	struct serve_request req;
+	int fds[3];
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = {&req, sizeof(req)};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
 
-	if (strcmp(command->name, "joker") == 0)
-	{
-		return joker(command);
-	}
+	ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (n < (ssize_t)sizeof(req) && (n <= 0 || !read_full(conn, (char *)&req + n, sizeof(req) - n)))
+		_exit(1);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)) ||
+		req.version != SERVE_VERSION || req.cwd_len >= PATH_MAX || req.line_len >= LINE_SIZE)
+		_exit(1);
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
 
-	if (strcmp(command->name, "pstraverse") == 0)
+	char cwd[PATH_MAX], line[LINE_SIZE];
+	if (!read_full(conn, cwd, req.cwd_len) || !read_full(conn, line, req.line_len))
+		_exit(1);
+	cwd[req.cwd_len] = 0;
+	line[req.line_len] = 0;
+
+	for (int i = 0; i < 3; ++i)
 	{
-		return pstraverse(command);
+		dup2(fds[i], i);
+		close(fds[i]);
 	}
-
-	if (strcmp(command->name, "trash") == 0)
+	int32_t status = 1;
+	if (chdir(cwd) == -1)
 	{
-		return trash(command);
+		fprintf(stderr, "-%s: %s: %s\n", sysname, cwd, strerror(errno));
+		write(conn, &status, sizeof(status)); // the line was meant for another directory
+		_exit(0);
 	}
+	prompt_cache_refresh();
 
-	pid_t pid = fork();
+	// a group of its own, so that forwarded signals reach every command of the line
+	setpgid(0, 0);
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_signal; // reset to the default by exec
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGQUIT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	pthread_t watcher;
+	pthread_create(&watcher, NULL, serve_watch, (void *)(intptr_t)conn);
 
-	if (pid == 0) // child
+	struct list_node *list = parse_command_line(line);
+	if (list)
+		run_list(list);
+	fflush(stdout);
+	status = last_status;
+	atomic_store(&serve_done, true);
+	write(conn, &status, sizeof(status));
+	_exit(0);
+}
+
+/**
+ * Accept command lines on a Unix socket until killed
+ * @param  path where to create the socket, replaced if it exists
+ * @return      exit status of the shell
+ */
+int serve(const char *path)
+{
+	struct sockaddr_un addr;
+	if (serve_address(path, &addr) == -1)
+		return 1;
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	unlink(path);
+	mode_t old_mask = umask(0077); // only the owner may connect
+	int bound = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+	umask(old_mask);
+	if (bound == -1 || listen(sock, 128) == -1)
 	{
-		// increase args size by 2
-		command->args = (char **)realloc(
-			command->args, sizeof(char *) * (command->arg_count += 2));
+		fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+		return 1;
+	}
 
-		// shift everything forward by 1
-		for (int i = command->arg_count - 2; i > 0; --i)
-			command->args[i] = command->args[i - 1];
+	// warm the caches every request starts from
+	builtin_table_build();
+	command_cache_refresh();
+	prompt_cache_refresh();
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, SIG_IGN); // requests are never waited for
 
-		// set args[0] as a copy of name
-		command->args[0] = strdup(command->name);
-		// set args[arg_count-1] (last) to NULL
-		command->args[command->arg_count - 1] = NULL;
+	while (1)
+	{
+		int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (conn == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			return 1;
+		}
 
-		/// TODO: do your own exec with path resolving using execv()
-		// check if the command starts with a './'
-		if (command->args[0][0] == '.' && command->args[0][1] == '/')
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+		if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 || cred.uid != getuid())
 		{
-			// if so, remove the './'
-			command->args[0] += 2;
-			execv(command->args[0], command->args);
+			close(conn);
+			continue;
 		}
-		else
+		command_cache_refresh(); // a cheap mtime check unless PATH changed
+
+		fflush(stdout);
+		if (fork() == 0)
 		{
-			// if not, try to find the command in the PATH
-			char *path = getenv("PATH");
-			char *path_token = strtok(path, ":");
-			while (path_token != NULL)
-			{
-				char *full_path = malloc(strlen(path_token) + strlen(command->args[0]) + 2);
-				strcpy(full_path, path_token);
-				strcat(full_path, "/");
-				strcat(full_path, command->args[0]);
-				execv(full_path, command->args);
-				free(full_path);
-				path_token = strtok(NULL, ":");
-			}
-			free(path);
+			signal(SIGCHLD, SIG_DFL); // the commands are waited for
+			signal(SIGPIPE, SIG_DFL);
+			close(sock);
+			serve_request(conn);
 		}
-		exit(0);
+		close(conn);
 	}
-	else
+}
+
+int serve_sock = -1;
+
+// Pass a signal of the client on to the request it waits for
+void serve_forward(int sig)
+{
+	unsigned char byte = sig;
+	write(serve_sock, &byte, 1);
+}
+
+/**
+ * Send a command line to a server started with --serve and wait for it
+ * @param  path socket of the server
+ * @param  line command line to run
+ * @return      exit status of the command line
+ */
+int serve_connect(const char *path, const char *line)
+{
+	struct sockaddr_un addr;
+	if (serve_address(path, &addr) == -1)
+		return 1;
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
 	{
-		/// TODO: Wait for child to finish if command is not running in background
-		if (!command->background)
-			waitpid(pid, NULL, 0);
+		fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+		return 1;
+	}
 
-		return SUCCESS;
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd)))
+		strcpy(cwd, "/");
+	struct serve_request req = {SERVE_VERSION, strlen(cwd), strlen(line)};
+	if (req.line_len >= LINE_SIZE)
+	{
+		fprintf(stderr, "-%s: command line too long\n", sysname);
+		return 1;
+	}
+
+	int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov[3] = {{&req, sizeof(req)}, {cwd, req.cwd_len}, {(char *)line, req.line_len}};
+	struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 3, .msg_control = control, .msg_controllen = sizeof(control)};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(sock, &msg, 0) != (ssize_t)(sizeof(req) + req.cwd_len + req.line_len))
+	{
+		fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+		return 1;
 	}
 
-	printf("-%s: %s: command not found\n", sysname, command->name);
-	return UNKNOWN;
-}
\ No newline at end of file
+	// Ctrl+C, Ctrl+\ and kill stop the commands on the server instead of only the client
+	serve_sock = sock;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_forward;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGQUIT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	int32_t status;
+	if (!read_full(sock, &status, sizeof(status)))
+	{
+		fprintf(stderr, "-%s: %s: the server closed the connection\n", sysname, path);
+		return 255;
+	}
+	return status;
+}
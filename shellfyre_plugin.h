@@ -0,0 +1,68 @@
+//
+// Interface for shellfyre builtin plugins
+//
+// A plugin is a shared object that defines a symbol named shellfyre_plugin.
+// The builtins it lists are registered next to the ones of the shell by
+// "load PATH" and removed again by "unload NAME". They run inside the shell
+// process, so calling them costs no fork or exec.
+//
+//     #include <stdio.h>
+//     #include "shellfyre_plugin.h"
+//
+//     static int hello(int argc, char **argv)
+//     {
+//         printf("hello %s\n", argc > 1 ? argv[1] : "world");
+//         return 0;
+//     }
+//
+//     static const struct shellfyre_builtin_def builtins[] = {
+//         {"hello", hello, "hello [NAME]: greet NAME"},
+//         {NULL, NULL, NULL},
+//     };
+//
+//     const struct shellfyre_plugin shellfyre_plugin = {
+//         .abi_version = SHELLFYRE_PLUGIN_ABI_VERSION,
+//         .name = "hello",
+//         .builtins = builtins,
+//     };
+//
+// Build it with "gcc -shared -fPIC -o hello.so hello.c" and load it with
+// "load ./hello.so".
+//
+// Rules for handlers:
+//  - argv[0] is the name of the builtin and argv[argc] is NULL. The strings
+//    belong to the shell and are freed after the handler returns.
+//  - The return value is the exit status of the command.
+//  - Handlers must not call exit(), must release what they allocate and must
+//    restore any signal handler or terminal setting they change.
+//  - Output written with stdio is flushed by the shell after the call.
+//
+
+#ifndef SHELLFYRE_PLUGIN_H
+#define SHELLFYRE_PLUGIN_H
+
+// Incremented whenever the structures below change incompatibly
+#define SHELLFYRE_PLUGIN_ABI_VERSION 1
+
+typedef int (*shellfyre_builtin_fn)(int argc, char **argv);
+
+struct shellfyre_builtin_def
+{
+	const char *name;
+	shellfyre_builtin_fn handler;
+	const char *help; // usage and one line description, shown by "builtins"
+};
+
+struct shellfyre_plugin
+{
+	int abi_version; // SHELLFYRE_PLUGIN_ABI_VERSION the plugin was built with
+	const char *name;
+	const struct shellfyre_builtin_def *builtins; // terminated by an entry with a NULL name
+
+	// Optional. init runs after loading, a non-zero return aborts the load.
+	// fini runs before the plugin is unloaded.
+	int (*init)(void);
+	void (*fini)(void);
+};
+
+#endif